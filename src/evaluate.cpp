@@ -134,6 +134,10 @@ void NNUE::init() {
                 }
             }
         }
+
+        if (evalFile.selected_name == user_eval_file)
+            sync_cout << "info string NNUE weights of " << user_eval_file << " on "
+                      << NNUE::large_pages_info(netSize) << sync_endl;
     }
 }
 
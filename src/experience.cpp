@@ -22,7 +22,10 @@
 #include <cassert>
 #include <iostream>
 #include <iomanip>
+#include <cmath>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <sstream>
 #include <fstream>
 #include <vector>
@@ -30,8 +33,10 @@
 #include <condition_variable>
 #include <mutex>
 #include <thread>
+#include <queue>
 #include "misc.h"
 #include "uci.h"
+#include "movegen.h"
 #include "position.h"
 #include "thread.h"
 #include "experience.h"
@@ -103,9 +108,11 @@ namespace Experience
     protected:
         bool        match;
         size_t      entriesCount;
+        size_t      entriesOffset;
+        size_t      entryStride;
 
     public:
-        ExperienceReader() : match(false), entriesCount(0) {}
+        ExperienceReader() : match(false), entriesCount(0), entriesOffset(0), entryStride(0) {}
         virtual ~ExperienceReader() = default;
 
     protected:
@@ -166,6 +173,9 @@ namespace Experience
 
             //Start fresh
             match = check_exp_count() && check_signature();
+
+            entriesOffset = signature.length();
+            entryStride = entrySize;
                 
             //Restore file pointer if it is not a match
             if(!match)
@@ -180,10 +190,38 @@ namespace Experience
             return entriesCount;
         }
 
+        //Location of the first entry read through the stream
+        size_t entries_offset()
+        {
+            return entriesOffset;
+        }
+
+        //Position 'input' on entry 'index', so that several streams can read parts of the same file
+        bool seek(ifstream& input, size_t index)
+        {
+            assert(match && index <= entriesCount);
+
+            input.seekg(entriesOffset + index * entryStride);
+            return (bool)input;
+        }
+
     public:
         virtual int get_version() = 0;
         virtual bool check_signature(ifstream& input, size_t inputLength) = 0;
         virtual bool read(ifstream& input, Current::ExpEntry* exp) = 0;
+
+        //Read 'count' entries starting at entry 'first'. Several threads can read parts of the same file, each with its own stream
+        virtual bool read_range(ifstream& input, size_t first, size_t count, Current::ExpEntry* exp)
+        {
+            if (!seek(input, first))
+                return false;
+
+            for (size_t i = 0; i < count; ++i)
+                if (!read(input, exp + i))
+                    return false;
+
+            return true;
+        }
     };
 
     ////////////////////////////////////////////////////////////////
@@ -196,11 +234,8 @@ namespace Experience
 
         class ExperienceReader : public Experience::ExperienceReader
         {
-        private:
-            ExpEntry entry;
-
         public:
-            explicit ExperienceReader() : entry((Key)0, MOVE_NONE, (Value)0, (Depth)0) {}
+            explicit ExperienceReader() {}
 
         public:
             virtual int get_version()
@@ -217,6 +252,7 @@ namespace Experience
             {
                 assert(match && input.is_open());
 
+                ExpEntry entry((Key)0, MOVE_NONE, (Value)0, (Depth)0);
                 if (!input.read((char*)&entry, sizeof(ExpEntry)))
                     return false;
 
@@ -268,1288 +304,5575 @@ namespace Experience
     }
 
     ////////////////////////////////////////////////////////////////
-    // Typedefs
-    ////////////////////////////////////////////////////////////////
-    typedef SugaRKeyMap<ExpEntryEx*> ExpMap;
-    typedef SugaRKeyMap<ExpEntryEx*>::iterator ExpIterator;
-    typedef SugaRKeyMap<ExpEntryEx*>::const_iterator ExpConstIterator;
-
-    ////////////////////////////////////////////////////////////////
-    // ExpEntryEx::quality
+    // V3
     ////////////////////////////////////////////////////////////////
-    pair<int, bool> ExpEntryEx::quality(Stockfish::Position& pos, int evalImportance) const
+    //Indexed experience file, meant to be memory mapped and probed in place. Layout:
+    //
+    // [signature, padded to HeaderOffset][Header, padded to DataOffset]
+    // [move records: ExpEntryEx, one block of contiguous records per position, best move first]
+    // [prefilter words][index buckets, cache line aligned]
+    // [tail: V2 entries appended by later (incremental) saves]
+    namespace V3
     {
-        const int QualityExperienceMovesAhead = 10;
-        const int QualityEvalImportanceMax = 10;
-
-        assert(evalImportance >= 0 && evalImportance <= QualityEvalImportanceMax);
+        const string ExperienceSignature = "SugaR Experience version 3";
+        const int    ExperienceVersion = 3;
 
-        //Draw detection
-        bool maybeDraw = false;
-
-        //Quality based on move count
-        int q = count * (QualityEvalImportanceMax - evalImportance);
+        constexpr size_t HeaderOffset = 64;
+        constexpr size_t DataOffset = 128;
 
-        //Quality based on difference in evaluation
-        if (evalImportance)
+        struct Header
         {
-            Color us = pos.side_to_move();
-            Color them = ~us;
-
-            //Calculate quality based on evaluation improvement of next moves
-            vector<Move> moves; //Used for doing/undoing of experience moves
-            StateInfo states[QualityExperienceMovesAhead];
+            uint64_t positions;     //Number of indexed positions
+            uint64_t records;       //Number of move records, starting at DataOffset
+            uint64_t filterOffset;  //Prefilter location and size (in 64-bit words)
+            uint64_t filterWords;
+            uint64_t indexOffset;   //Index location and size (in buckets)
+            uint64_t bucketCount;
+            uint64_t tailOffset;    //End of the indexed data
+            uint64_t filterFprPpm;  //Expected false positive rate of the prefilter in parts per million
+        };
 
-            int64_t sum[COLOR_NB] = { 0, 0 };
-            int64_t weight[COLOR_NB] = { 0, 0 };
+        static_assert(sizeof(Header) == 64);
+        static_assert(HeaderOffset + sizeof(Header) <= DataOffset);
 
-            //Start our sum/weight with something positive!
-            sum[us] = count;
-            weight[us] = 1;
+        class ExperienceReader : public Experience::ExperienceReader
+        {
+        public:
+            explicit ExperienceReader() {}
 
-            //Look ahead
-            Color me = us;
-            const ExpEntryEx* lastExp[COLOR_NB] = { nullptr, nullptr };
-            const ExpEntryEx* temp1 = this;
-            while (true)
+        public:
+            virtual int get_version()
             {
-                //To be used later
-                lastExp[me] = temp1;
+                return ExperienceVersion;
+            }
 
-                //Do the move
-                moves.emplace_back(temp1->move);
-                pos.do_move(moves.back(), states[moves.size() - 1]);
-                me = ~me;
+            //Only the tail is read through the stream, the indexed data is memory mapped
+            virtual bool check_signature(ifstream& input, size_t inputLength)
+            {
+                assert(input && input.is_open() && inputLength);
 
-                if (!maybeDraw)
-                    maybeDraw = pos.is_draw(pos.game_ply());
+                match = false;
+                entriesCount = 0;
 
-                if (moves.size() >= QualityExperienceMovesAhead)
-                    break;
+                if (inputLength < DataOffset)
+                    return false;
 
-                //Probe the new position
-                temp1 = probe(pos.key());
-                if (!temp1)
-                    break;
+                string signature(ExperienceSignature.length(), '\0');
+                Header header;
 
-                //Find best next experience move (shallow search)
-                const ExpEntryEx* temp2 = temp1 ? temp1->next : nullptr;
-                while (temp2)
+                input.seekg(ios::beg);
+                if (   !input.read(&signature[0], signature.length())
+                    || signature != ExperienceSignature
+                    || !input.seekg(HeaderOffset)
+                    || !input.read((char*)&header, sizeof(Header))
+                    || header.tailOffset < DataOffset
+                    || header.tailOffset > inputLength
+                    || (inputLength - header.tailOffset) % sizeof(V2::ExpEntry))
                 {
-                    if (temp2->compare(temp1) > 0)
-                        temp1 = temp2;
-
-                    temp2 = temp2->next;
+                    input.clear();
+                    input.seekg(ios::beg);
+                    return false;
                 }
 
-                if (lastExp[me])
-                {
-                    sum[me] += (int64_t)(temp1->value - lastExp[me]->value);
-                    ++weight[me];
-                }
+                entriesCount = (inputLength - header.tailOffset) / sizeof(V2::ExpEntry);
+                entriesOffset = header.tailOffset;
+                entryStride = sizeof(V2::ExpEntry);
+                input.seekg(header.tailOffset);
+
+                return match = true;
             }
 
-            //Undo moves
-            for (auto it = moves.rbegin(); it != moves.rend(); ++it)
-                pos.undo_move(*it);
+            virtual bool read(ifstream& input, Current::ExpEntry* exp)
+            {
+                assert(match && input.is_open());
 
-            //Calculate quality
-            int64_t s = 0;
-            int64_t w = 0;
+                if (!input.read((char*)exp, sizeof(V2::ExpEntry)))
+                    return false;
 
-            if (weight[us]) //Will always be true since weight[us] is initialized to 1 earlier
-            {
-                s += sum[us];
-                w += weight[us];
+                return true;
             }
+        };
+    }
 
-            if (weight[them])
+    ////////////////////////////////////////////////////////////////
+    // V4
+    ////////////////////////////////////////////////////////////////
+    //Compressed experience file. Layout:
+    //
+    // [signature, padded to HeaderOffset][Header, padded to DataOffset]
+    // [blocks of move records, sorted by position key][block index: one BlockInfo per block]
+    // [tail: V2 entries appended by later (incremental) saves]
+    //
+    //A record is the varint of the key delta to the previous record (zero for the other moves of the
+    //same position), the 16-bit move, and the varint of depth, value and count packed together. The
+    //first record of a block is relative to the first key of the block and positions are not split
+    //across blocks, so each block can be decoded on its own
+    namespace V4
+    {
+        const string ExperienceSignature = "SugaR Experience version 4";
+        const int    ExperienceVersion = 4;
+
+        constexpr size_t HeaderOffset = 64;
+        constexpr size_t DataOffset = 128;
+
+        //A block is closed at the end of the position that reaches this number of records
+        constexpr size_t BlockRecords = 4096;
+
+        struct Header
+        {
+            uint64_t positions;     //Number of positions
+            uint64_t records;       //Number of move records, in the blocks starting at DataOffset
+            uint64_t blockCount;    //Block index location and size (in blocks)
+            uint64_t indexOffset;
+            uint64_t tailOffset;    //End of the compressed data
+            uint64_t reserved[3];
+        };
+
+        struct BlockInfo
+        {
+            uint64_t firstKey;      //Key of the first position of the block
+            uint64_t offset;        //Location of the block
+            uint64_t firstRecord;   //Number of records in the previous blocks
+        };
+
+        static_assert(sizeof(Header) == 64);
+        static_assert(HeaderOffset + sizeof(Header) <= DataOffset);
+
+        inline void put_varint(vector<char>& out, uint64_t v)
+        {
+            for (; v >= 0x80; v >>= 7)
+                out.push_back((char)(v | 0x80));
+
+            out.push_back((char)v);
+        }
+
+        inline bool get_varint(const unsigned char*& p, const unsigned char* end, uint64_t& v)
+        {
+            v = 0;
+            for (int shift = 0; p < end && shift < 64; shift += 7)
             {
-                s -= sum[them];
-                w += weight[them];
+                v |= (uint64_t)(*p & 0x7F) << shift;
+                if (!(*p++ & 0x80))
+                    return true;
             }
 
-            q += s * evalImportance / w;
+            return false;
         }
-        else
+
+        //Depth in the low 8 bits, then the zigzag encoded value in 16 bits and the count: records with a small value
+        //and count fit in 4 bytes
+        inline uint64_t pack(Value v, Depth d, uint16_t c)
         {
-            //Shallow draw detection when 'evalImportance' is zero!
-            StateInfo st;
-            pos.do_move(move, st);
-            maybeDraw = pos.is_draw(pos.game_ply());
-            pos.undo_move(move);
+            assert(v >= -32768 && v <= 32767);
+
+            uint64_t zigzag = v < 0 ? ((uint64_t)-v << 1) - 1 : (uint64_t)v << 1;
+            return (uint64_t)std::clamp((int)d, 0, 255) | (zigzag << 8) | ((uint64_t)c << 24);
         }
 
-        return pair<int, bool>(q / QualityEvalImportanceMax, maybeDraw);
-    }
+        inline bool unpack(uint64_t packed, Value& v, Depth& d, uint16_t& c)
+        {
+            if (packed >> 40)
+                return false;
 
-    //Experience data
-    namespace
-    {
-#ifndef NDEBUG
-        constexpr size_t WriteBufferSize = 1024;
-#else
-        constexpr size_t WriteBufferSize = 1024 * 1024 * 16;
-#endif
-        
-        class ExperienceData
+            uint64_t zigzag = (packed >> 8) & 0xFFFF;
+
+            d = (Depth)(packed & 0xFF);
+            v = (Value)(zigzag & 1 ? -(int)((zigzag + 1) >> 1) : (int)(zigzag >> 1));
+            c = (uint16_t)(packed >> 24);
+            return true;
+        }
+
+        //Writes a compressed experience file. The entries must be written by increasing key, and
+        //the moves of a position one after the other
+        class Writer
         {
         private:
-            string              _filename;
+            ofstream          _out;
+            Header            _header;
+            vector<BlockInfo> _blocks;
+            vector<char>      _block;
+            size_t            _blockRecords;
+            uint64_t          _offset;
+            Key               _lastKey;
+
+            bool flush_block()
+            {
+                _out.write(_block.data(), _block.size());
+                _offset += _block.size();
 
-            vector<ExpEntryEx*> _expData;
-            vector<ExpEntryEx*> _newPvExp;
-            vector<ExpEntryEx*> _newMultiPvExp;
-            vector<ExpEntryEx*> _oldExpData;
+                _block.clear();
+                _blockRecords = 0;
 
-            ExpMap              _mainExp;
+                return (bool)_out;
+            }
 
-            bool                _loading;
-            atomic<bool>        _abortLoading;
-            atomic<bool>        _loadingResult;
-            thread              *_loaderThread;
-            condition_variable  _loadingCond;
-            mutex               _loaderMutex;
+        public:
+            bool open(const string& fn)
+            {
+                _out.open(fn, ios::out | ios::binary | ios::trunc);
+                if (!_out.is_open())
+                    return false;
 
-        private:
-            void clear()
+                //Signature, the header is written last
+                string preamble(DataOffset, '\0');
+                preamble.replace(0, ExperienceSignature.length(), ExperienceSignature);
+                _out.write(preamble.data(), preamble.size());
+
+                memset((void*)&_header, 0, sizeof(_header));
+                _blocks.clear();
+                _block.clear();
+                _blockRecords = 0;
+                _offset = DataOffset;
+                _lastKey = 0;
+
+                return (bool)_out;
+            }
+
+            bool write(const Current::ExpEntry& e)
             {
-                //Make sure we are not loading an experience file
-                _abortLoading.store(true, memory_order_relaxed);
-                wait_for_load_finished();
-                assert(_loaderThread == nullptr);
+                assert(!_header.records || e.key >= _lastKey);
 
-                //Clear new exp (this will also flush all new experience data to '_oldExpData' which we will delete later in this function
-                clear_new_exp();
+                if (!_header.records || e.key != _lastKey)
+                {
+                    if (_blockRecords >= BlockRecords && !flush_block())
+                        return false;
 
-                //Free main exp data
-                for (ExpEntryEx *&p : _expData)
-                    free(p);
+                    if (!_blockRecords)
+                        _blocks.push_back(BlockInfo{ e.key, _offset, _header.records });
 
-                //Delete previous game experience data
-                for (ExpEntryEx*& p : _oldExpData)
-                    delete p;
+                    _header.positions++;
+                }
 
-                //Clear
-                _mainExp.clear();
-                _oldExpData.clear();
-                _expData.clear();
+                put_varint(_block, _blockRecords ? e.key - _lastKey : 0);
+                _block.push_back((char)((uint16_t)e.move & 0xFF));
+                _block.push_back((char)((uint16_t)e.move >> 8));
+                put_varint(_block, pack((Value)e.value, (Depth)e.depth, e.count));
+
+                _lastKey = e.key;
+                _blockRecords++;
+                _header.records++;
+
+                return true;
             }
 
-            void clear_new_exp()
+            bool close()
             {
-                //Copy exp data to another buffer to be deleted when the whole object is destroyed or new exp file is loaded
-                for (auto& newExp : { _newPvExp, _newMultiPvExp })
-                    std::copy(newExp.begin(), newExp.end(), back_inserter(_oldExpData));
+                if (_blockRecords && !flush_block())
+                    return false;
 
-                //Clear vectors
-                _newPvExp.clear();
-                _newMultiPvExp.clear();
+                _header.blockCount = _blocks.size();
+                _header.indexOffset = _offset;
+                _header.tailOffset = _offset + _blocks.size() * sizeof(BlockInfo);
+
+                _out.write(reinterpret_cast<const char*>(_blocks.data()), _blocks.size() * sizeof(BlockInfo));
+                _out.seekp(HeaderOffset);
+                _out.write(reinterpret_cast<const char*>(&_header), sizeof(_header));
+                _out.close();
+
+                return !_out.fail();
             }
 
-            bool link_entry(ExpEntryEx* exp)
+            uint64_t positions() const
             {
-                ExpIterator itr = _mainExp.find(exp->key);
+                return _header.positions;
+            }
 
-                //If new entry: insert into map and continue
-                if (itr == _mainExp.end())
-                {
-                    _mainExp[exp->key] = exp;
-                    return true;
-                }
+            uint64_t records() const
+            {
+                return _header.records;
+            }
+        };
 
-                //If existing entry and same move exists then merge
-                ExpEntryEx* exp2 = itr->second->find(exp->move);
-                if (exp2)
-                {
-                    exp2->merge(exp);
+        class ExperienceReader : public Experience::ExperienceReader
+        {
+        private:
+            Header            header;
+            vector<BlockInfo> blocks;
+
+            //Decode 'count' records of block 'b', after skipping its first 'skip' records
+            bool read_block(ifstream& input, size_t b, size_t skip, size_t count, Current::ExpEntry* exp, vector<unsigned char>& data)
+            {
+                size_t end = b + 1 < blocks.size() ? blocks[b + 1].offset : header.indexOffset;
+
+                data.resize(end - blocks[b].offset);
+                if (!input.seekg(blocks[b].offset) || !input.read((char*)data.data(), data.size()))
                     return false;
-                }
 
-                //If existing entry and different move then insert sorted based on pseudo-quality
-                exp2 = itr->second;
-                do
+                const unsigned char* p = data.data();
+                const unsigned char* pEnd = p + data.size();
+
+                Key key = blocks[b].firstKey;
+                for (size_t r = 0; r < skip + count; ++r)
                 {
-                    if (exp->compare(exp2) > 0)
-                    {
-                        if (exp2 == itr->second)
-                        {
-                            itr->second = exp;
-                            exp->next = exp2;
-                        }
-                        else
-                        {
-                            exp->next = exp2->next;
-                            exp2->next = exp;
-                        }
+                    uint64_t delta, packed;
+                    if (!get_varint(p, pEnd, delta) || pEnd - p < 2)
+                        return false;
 
-                        return true;
-                    }
+                    Move move = (Move)(p[0] | (p[1] << 8));
+                    p += 2;
 
-                    if (!exp2->next)
-                    {
-                        exp2->next = exp;
-                        return true;
-                    }
+                    Value value;
+                    Depth depth;
+                    uint16_t count16;
+                    if (!get_varint(p, pEnd, packed) || !unpack(packed, value, depth, count16))
+                        return false;
 
-                    exp2 = exp2->next;
-                } while (true);
+                    key += delta;
+                    if (r >= skip)
+                        new (exp + (r - skip)) Current::ExpEntry(key, move, value, depth, count16);
+                }
 
-                //Should never reach here!
-                assert(false);
                 return true;
             }
 
-            bool _load(string fn)
+        public:
+            explicit ExperienceReader() {}
+
+        public:
+            virtual int get_version()
             {
-                ifstream in(Utility::map_path(fn), ios::in | ios::binary | ios::ate);
-                if (!in.is_open())
-                {
-                    sync_cout << "info string Could not open experience file: " << fn << sync_endl;
+                return ExperienceVersion;
+            }
+
+            //The block index is kept in memory, the blocks are read when needed
+            virtual bool check_signature(ifstream& input, size_t inputLength)
+            {
+                assert(input && input.is_open() && inputLength);
+
+                match = false;
+                entriesCount = 0;
+                blocks.clear();
+
+                if (inputLength < DataOffset)
                     return false;
+
+                string signature(ExperienceSignature.length(), '\0');
+
+                input.seekg(ios::beg);
+                bool valid =    input.read(&signature[0], signature.length())
+                             && signature == ExperienceSignature
+                             && input.seekg(HeaderOffset)
+                             && input.read((char*)&header, sizeof(Header))
+                             && header.indexOffset >= DataOffset
+                             && header.tailOffset == header.indexOffset + header.blockCount * sizeof(BlockInfo)
+                             && header.tailOffset <= inputLength
+                             && (inputLength - header.tailOffset) % sizeof(V2::ExpEntry) == 0;
+
+                if (valid)
+                {
+                    blocks.resize(header.blockCount);
+                    valid = input.seekg(header.indexOffset) && input.read((char*)blocks.data(), blocks.size() * sizeof(BlockInfo));
+
+                    for (size_t b = 0; valid && b < blocks.size(); ++b)
+                        valid =    (b ? blocks[b].offset > blocks[b - 1].offset : blocks[b].offset == DataOffset) && blocks[b].offset < header.indexOffset
+                                && blocks[b].firstRecord >= (b ? blocks[b - 1].firstRecord + 1 : 0) && blocks[b].firstRecord < header.records;
+
+                    valid = valid && (blocks.empty() ? header.records == 0 : blocks[0].firstRecord == 0);
                 }
 
-                size_t inSize = in.tellg();
-                if (inSize == 0)
+                if (!valid)
                 {
-                    sync_cout << "info string The experience file [" << fn << "] is empty" << sync_endl;
+                    blocks.clear();
+                    input.clear();
+                    input.seekg(ios::beg);
                     return false;
                 }
 
-                //Define readers
-                //Order should be from most recent to oldest
-                class ExpReaders
-                {
-                public:
-                    vector<pair<const char*, ExperienceReader*>> readers;
+                entriesCount = header.records + (inputLength - header.tailOffset) / sizeof(V2::ExpEntry);
+                entriesOffset = header.tailOffset;
+                entryStride = sizeof(V2::ExpEntry);
+                input.seekg(header.tailOffset);
 
-                public:
-                    ExpReaders()
-                    {
-                        readers.emplace_back("Experience (V2) reader", new V2::ExperienceReader());
-                        readers.emplace_back("Experience (V1) reader", new V1::ExperienceReader());
+                return match = true;
+            }
 
-#ifndef NDEBUG
-                        int latest = 0;
-                        for (auto& rp : readers)
-                            latest += rp.second->get_version() == Current::ExperienceVersion ? 1 : 0;
+            //Reads the tail
+            virtual bool read(ifstream& input, Current::ExpEntry* exp)
+            {
+                assert(match && input.is_open());
 
-                        assert(latest == 1);
-#endif
-                    }
+                if (!input.read((char*)exp, sizeof(V2::ExpEntry)))
+                    return false;
 
-                    ~ExpReaders()
-                    {
-                        for (auto rp : readers)
-                            delete rp.second;
-                    }
-                }expReaders;
+                return true;
+            }
+
+            //Entries are numbered from the first record of the first block to the last entry of the tail
+            virtual bool read_range(ifstream& input, size_t first, size_t count, Current::ExpEntry* exp)
+            {
+                assert(match && first + count <= entriesCount);
 
-                ExperienceReader *reader = nullptr;
-                for (auto &rp : expReaders.readers)
+                vector<unsigned char> data;
+                while (count && first < header.records)
                 {
-                    if (!rp.second)
-                    {
-                        sync_cout << "info string Could not allocate memory for " << rp.first << sync_endl;
-                        continue;
-                    }
+                    size_t b = upper_bound(blocks.begin(), blocks.end(), first, [](size_t r, const BlockInfo& bi) { return r < bi.firstRecord; }) - blocks.begin() - 1;
+                    size_t blockEnd = b + 1 < blocks.size() ? blocks[b + 1].firstRecord : header.records;
+                    size_t n = std::min(count, blockEnd - first);
 
-                    if (rp.second->check_signature(in, inSize))
-                    {
-                        reader = rp.second;
-                        break;
-                    }
-                }
+                    if (!read_block(input, b, first - blocks[b].firstRecord, n, exp, data))
+                        return false;
 
-                if (!reader)
-                {
-                    sync_cout << "info string The file [" << fn << "] is not a valid experience file" << sync_endl;
-                    return false;
+                    first += n;
+                    count -= n;
+                    exp += n;
                 }
 
-                if (reader->get_version() != Current::ExperienceVersion)
-                    sync_cout << "info string Importing experience version (" << reader->get_version() << ") from file [" << fn << "]" << sync_endl;
+                return !count || Experience::ExperienceReader::read_range(input, first - header.records, count, exp);
+            }
+        };
+    }
 
-                //Allocate buffer for ExpEntryEx data
-                size_t expCount = reader->entries_count();
-                ExpEntryEx* expData = (ExpEntryEx*)malloc(expCount * sizeof(ExpEntryEx));
-                if (!expData)
-                {
-                    sync_cout << "info string Failed to allocate " << expCount * sizeof(ExpEntryEx) << " bytes for experience data from file [" << fn << "]" << sync_endl;
-                    return false;
-                }
+    ////////////////////////////////////////////////////////////////
+    // Typedefs
+    ////////////////////////////////////////////////////////////////
+    typedef SugaRKeyMap<ExpEntryEx*> ExpMap;
+    typedef SugaRKeyMap<ExpEntryEx*>::iterator ExpIterator;
+    typedef SugaRKeyMap<ExpEntryEx*>::const_iterator ExpConstIterator;
 
-                //Few variables to be used for statistical information
-                size_t prevPosCount = _mainExp.size();
+    ////////////////////////////////////////////////////////////////
+    // Quality cache
+    ////////////////////////////////////////////////////////////////
+    //ExpEntryEx::quality() plays up to 10 experience moves ahead, so its results are kept for
+    //the (position, move, eval importance) triples asked recently. The position includes the
+    //history its draw detection depends on. A result is discarded once the experience of one
+    //of the positions it looked at changes, or when experience is loaded or cleared as a whole
+    namespace
+    {
+        //Changes whenever experience is loaded, reloaded or cleared
+        atomic<uint64_t> experienceGeneration(1);
 
-                //Load experience entries
-                size_t duplicateMoves = 0;
-                ExpEntryEx *exp = expData;
-                for (size_t i = 0; i < expCount; ++i, ++exp)
-                {
-                    if (_abortLoading.load(memory_order_relaxed))
-                        break;
+        //Positions are grouped in slots, each holding the tick of the last change of one of its positions
+        constexpr size_t PositionSlots = 4096;
+        atomic<uint64_t> positionTick(0);
+        atomic<uint64_t> positionChanges[PositionSlots];
 
-                    //Prepare to read
-                    exp->next = nullptr;
+        size_t position_slot(Key k)
+        {
+            return mul_hi64(k, PositionSlots);
+        }
 
-                    //Read
-                    if (!reader->read(in, exp))
-                    {
-                        sync_cout << "info string Failed to read experience entry #" << i + 1 << " of " << expCount << sync_endl;
+        void experience_changed()
+        {
+            experienceGeneration.fetch_add(1, memory_order_relaxed);
+        }
 
-                        delete expData;
-                        return false;
-                    }
+        void position_changed(Key k)
+        {
+            positionChanges[position_slot(k)].store(positionTick.fetch_add(1, memory_order_relaxed) + 1, memory_order_relaxed);
+        }
 
-                    //Merge
-                    if (!link_entry(exp))
-                        duplicateMoves++;
-                }
+        class QualityCache
+        {
+        private:
+            static constexpr size_t Size = 4096;
 
-                //Close input file
-                in.close();
+            struct Entry
+            {
+                Key      key;
+                uint64_t generation;
+                uint64_t tick;
+                Move     move;
+                int      evalImportance;
+                int      quality;
+                bool     maybeDraw;
+                uint8_t  slotCount;
+                uint16_t slots[ExpEntryEx::QualityMovesAhead];
+            };
 
-                //Add buffer to vector so that it will be released later
-                _expData.push_back(expData);
+            Entry _entries[Size] = {};
+            mutex _mutex;
 
-                //Stop if aborted
-                if (_abortLoading.load(memory_order_relaxed))
-                    return false;
+            static size_t index(Key k, Move m, int evalImportance)
+            {
+                return mul_hi64(k ^ ((uint64_t)m << 8) ^ (uint64_t)evalImportance, Size);
+            }
+
+        public:
+            //Position key mixed with the keys of the previous positions which can be repeated, and the 50-move counter
+            static Key context_key(const Position& pos)
+            {
+                const StateInfo* st = pos.state();
+                Key k = pos.key() ^ (Key)pos.rule50_count();
 
-                if (reader->get_version() != Current::ExperienceVersion)
+                for (int i = std::min(st->rule50, st->pliesFromNull); i > 0 && st->previous; --i)
                 {
-                    sync_cout << "info string Upgrading experience file (" << fn << ") from version (" << reader->get_version() << ") to version (" << Current::ExperienceVersion << ")" << sync_endl;
-                    save(fn, true, true);
+                    st = st->previous;
+                    k = (k ^ st->key) * 0x9E3779B97F4A7C15ULL;
                 }
 
-                //Stop if aborted
-                if (_abortLoading.load(memory_order_relaxed))
+                return k;
+            }
+
+            bool get(Key k, Move m, int evalImportance, pair<int, bool>& result)
+            {
+                lock_guard<mutex> lg(_mutex);
+
+                const Entry& e = _entries[index(k, m, evalImportance)];
+                if (   e.key != k || e.move != m || e.evalImportance != evalImportance
+                    || e.generation != experienceGeneration.load(memory_order_relaxed))
                     return false;
 
-                //Show some statistics
-                if (prevPosCount)
+                for (int i = 0; i < e.slotCount; ++i)
+                    if (positionChanges[e.slots[i]].load(memory_order_relaxed) > e.tick)
+                        return false;
+
+                result = pair<int, bool>(e.quality, e.maybeDraw);
+                return true;
+            }
+
+            void put(Key k, Move m, int evalImportance, uint64_t generation, uint64_t tick, const Key* probed, int probedCount, const pair<int, bool>& result)
+            {
+                lock_guard<mutex> lg(_mutex);
+
+                Entry& e = _entries[index(k, m, evalImportance)];
+                e = Entry{ k, generation, tick, m, evalImportance, result.first, result.second, uint8_t(probedCount), {} };
+                for (int i = 0; i < probedCount; ++i)
+                    e.slots[i] = uint16_t(position_slot(probed[i]));
+            }
+        };
+
+        QualityCache qualityCache;
+    }
+
+    ////////////////////////////////////////////////////////////////
+    // ExpEntryEx::quality
+    ////////////////////////////////////////////////////////////////
+    pair<int, bool> ExpEntryEx::quality(Stockfish::Position& pos, int evalImportance) const
+    {
+        Key contextKey = QualityCache::context_key(pos);
+
+        pair<int, bool> result;
+        if (qualityCache.get(contextKey, (Move)move, evalImportance, result))
+            return result;
+
+        //Experience may change while the quality is calculated: the result is then stored as already outdated
+        uint64_t generation = experienceGeneration.load(memory_order_relaxed);
+        uint64_t tick = positionTick.load(memory_order_relaxed);
+
+        Key probed[QualityMovesAhead];
+        int probedCount = 0;
+        result = compute_quality(pos, evalImportance, probed, probedCount);
+        qualityCache.put(contextKey, (Move)move, evalImportance, generation, tick, probed, probedCount, result);
+
+        return result;
+    }
+
+    pair<int, bool> ExpEntryEx::compute_quality(Stockfish::Position& pos, int evalImportance, Key* probed, int& probedCount) const
+    {
+        const int QualityEvalImportanceMax = 10;
+
+        assert(evalImportance >= 0 && evalImportance <= QualityEvalImportanceMax);
+
+        //The result depends on the experience of this position and of the positions probed ahead
+        probed[probedCount++] = key;
+
+        //Draw detection
+        bool maybeDraw = false;
+
+        //Quality based on move count
+        int q = count * (QualityEvalImportanceMax - evalImportance);
+
+        //Quality based on difference in evaluation
+        if (evalImportance)
+        {
+            Color us = pos.side_to_move();
+            Color them = ~us;
+
+            //Calculate quality based on evaluation improvement of next moves
+            vector<Move> moves; //Used for doing/undoing of experience moves
+            StateInfo states[QualityMovesAhead];
+
+            int64_t sum[COLOR_NB] = { 0, 0 };
+            int64_t weight[COLOR_NB] = { 0, 0 };
+
+            //Start our sum/weight with something positive!
+            sum[us] = count;
+            weight[us] = 1;
+
+            //Look ahead
+            Color me = us;
+            const ExpEntryEx* lastExp[COLOR_NB] = { nullptr, nullptr };
+            const ExpEntryEx* temp1 = this;
+            while (true)
+            {
+                //To be used later
+                lastExp[me] = temp1;
+
+                //Do the move
+                moves.emplace_back(temp1->move);
+                pos.do_move(moves.back(), states[moves.size() - 1]);
+                me = ~me;
+
+                if (!maybeDraw)
+                    maybeDraw = pos.is_draw(pos.game_ply());
+
+                if (moves.size() >= QualityMovesAhead)
+                    break;
+
+                //Probe the new position
+                probed[probedCount++] = pos.key();
+                temp1 = probe(pos.key());
+                if (!temp1)
+                    break;
+
+                //Find best next experience move (shallow search)
+                const ExpEntryEx* temp2 = temp1 ? temp1->next() : nullptr;
+                while (temp2)
                 {
-                    sync_cout
-                        << "info string " << fn << " -> Total new moves: " << expCount
-                        << ". Total new positions: " << (_mainExp.size() - prevPosCount)
-                        << ". Duplicate moves: " << duplicateMoves
-                        << sync_endl;
+                    if (temp2->compare(temp1) > 0)
+                        temp1 = temp2;
+
+                    temp2 = temp2->next();
                 }
-                else
+
+                if (lastExp[me])
                 {
-                    sync_cout
-                        << "info string " << fn << " -> Total moves: " << expCount
-                        << ". Total positions: " << _mainExp.size()
-                        << ". Duplicate moves: " << duplicateMoves
-                        << ". Fragmentation: " << setprecision(2) << fixed << 100.0 * (double)duplicateMoves / (double)expCount << "%"
-                        << sync_endl;
+                    sum[me] += (int64_t)(temp1->value - lastExp[me]->value);
+                    ++weight[me];
                 }
+            }
 
-                return true;
+            //Undo moves
+            for (auto it = moves.rbegin(); it != moves.rend(); ++it)
+                pos.undo_move(*it);
+
+            //Calculate quality
+            int64_t s = 0;
+            int64_t w = 0;
+
+            if (weight[us]) //Will always be true since weight[us] is initialized to 1 earlier
+            {
+                s += sum[us];
+                w += weight[us];
             }
 
-            bool _save(string fn, bool saveAll)
+            if (weight[them])
             {
-                fstream out;
-                out.open(Utility::map_path(fn), ios::out | ios::binary | ios::app);
-                if (!out.is_open())
-                {
-                    sync_cout << "info string Failed to open experience file [" << fn << "] for writing" << sync_endl;
-                    return false;
-                }
+                s -= sum[them];
+                w += weight[them];
+            }
 
-                //If this is a new file then we need to write the signature first
-                out.seekg(0, out.end);
-                size_t length = out.tellg();
-                out.seekg(0, out.beg);
+            q += s * evalImportance / w;
+        }
+        else
+        {
+            //Shallow draw detection when 'evalImportance' is zero!
+            StateInfo st;
+            pos.do_move(move, st);
+            maybeDraw = pos.is_draw(pos.game_ply());
+            pos.undo_move(move);
+        }
 
-                if (length == 0)
-                {
-                    out.seekp(0, out.beg);
+        return pair<int, bool>(q / QualityEvalImportanceMax, maybeDraw);
+    }
 
-                    out << Current::ExperienceSignature;
-                    if (!out)
-                    {
-                        sync_cout << "info string Failed to write signature to experience file [" << fn << "]" << sync_endl;
-                        return false;
-                    }
-                }
+    //Experience data
+    namespace
+    {
+#ifndef NDEBUG
+        constexpr size_t WriteBufferSize = 1024;
+#else
+        constexpr size_t WriteBufferSize = 1024 * 1024 * 16;
+#endif
 
-                //Reposition writing pointer to end of file
-                out.seekp(ios::end);
+        //A journal is merged into the experience file once it reaches this size or this fraction of the experience file
+        constexpr size_t JournalMinCompactionSize = 64 * 1024;
+        constexpr size_t JournalCompactionRatio = 16;
 
-                vector<char> writeBuffer;
-                writeBuffer.reserve(WriteBufferSize);
+        //Entries read by a loader thread at a time, and number of entries from which loading progress is shown
+        constexpr size_t LoadChunkSize = 1024 * 1024;
+        constexpr size_t LoadProgressMinEntries = 16 * LoadChunkSize;
 
-                auto write_entry = [&](const Current::ExpEntry* exp, bool force) -> bool
-                {
-                    if (exp)
-                    {
-                        const char* data = reinterpret_cast<const char*>(exp);
-                        writeBuffer.insert(writeBuffer.end(), data, data + sizeof(Current::ExpEntry));
-                    }
+        ////////////////////////////////////////////////////////////////
+        // ExpReaders
+        ////////////////////////////////////////////////////////////////
+        //All the experience readers. Order should be from most recent to oldest
+        class ExpReaders
+        {
+        public:
+            vector<pair<const char*, ExperienceReader*>> readers;
 
-                    bool success = true;
-                    if (force || writeBuffer.size() >= WriteBufferSize)
-                    {
+        public:
+            ExpReaders()
+            {
+                readers.emplace_back("Experience (V4) reader", new V4::ExperienceReader());
+                readers.emplace_back("Experience (V3) reader", new V3::ExperienceReader());
+                readers.emplace_back("Experience (V2) reader", new V2::ExperienceReader());
+                readers.emplace_back("Experience (V1) reader", new V1::ExperienceReader());
+
+#ifndef NDEBUG
+                int latest = 0;
+                for (auto& rp : readers)
+                    latest += rp.second->get_version() == Current::ExperienceVersion ? 1 : 0;
+
+                assert(latest == 1);
+#endif
+            }
+
+            ~ExpReaders()
+            {
+                for (auto rp : readers)
+                    delete rp.second;
+            }
+
+            //Reader of the given experience file, positioned on its first entry. nullptr if no reader recognizes the file
+            ExperienceReader* find(ifstream& in, size_t inSize)
+            {
+                for (auto& rp : readers)
+                {
+                    if (!rp.second)
+                    {
+                        sync_cout << "info string Could not allocate memory for " << rp.first << sync_endl;
+                        continue;
+                    }
+
+                    if (rp.second->check_signature(in, inSize))
+                        return rp.second;
+                }
+
+                return nullptr;
+            }
+        };
+
+        //Format and number of entries of an experience file. False if it is not a valid experience file
+        bool experience_file_info(const string& fn, int& version, size_t& entries)
+        {
+            ifstream in(fn, ios::in | ios::binary | ios::ate);
+            if (!in.is_open())
+                return false;
+
+            size_t inSize = in.tellg();
+            ExpReaders expReaders;
+            ExperienceReader* reader = inSize ? expReaders.find(in, inSize) : nullptr;
+            if (!reader)
+                return false;
+
+            version = reader->get_version();
+            entries = reader->entries_count();
+            return true;
+        }
+
+        ////////////////////////////////////////////////////////////////
+        // Move lists
+        ////////////////////////////////////////////////////////////////
+        //The moves of a position are a block of contiguous entries, sorted based on pseudo-quality.
+        //Blocks are never resized: adding a move to a position builds a new block, which replaces
+        //the previous one. Moves are added exactly as they would be inserted in a sorted list, so
+        //the result depends on the order in which they are added
+        class ExpPositionBuilder
+        {
+        public:
+            //More than the number of legal moves in any position
+            static constexpr size_t MaxMoves = 256;
+
+        private:
+            alignas(ExpEntryEx) unsigned char _moves[MaxMoves * sizeof(ExpEntryEx)];
+            size_t _size;
+
+            ExpEntryEx* moves()
+            {
+                return reinterpret_cast<ExpEntryEx*>(_moves);
+            }
+
+        public:
+            ExpPositionBuilder() : _size(0) {}
+
+            size_t size() const
+            {
+                return _size;
+            }
+
+            //Start from the moves of an existing block (nullptr for a new position)
+            void assign(const ExpEntryEx* head)
+            {
+                for (_size = 0; head && _size < MaxMoves; head = head->next())
+                    new (&moves()[_size++]) ExpEntryEx(head->key, (Move)head->move, (Value)head->value, (Depth)head->depth, head->count);
+            }
+
+            //Returns false if the same move already exists, in which case 'exp' is merged into it
+            //(or if the position already has too many moves, in which case 'exp' is dropped)
+            bool add(const Current::ExpEntry* exp)
+            {
+                ExpEntryEx* first = moves();
+                ExpEntryEx* last = first + _size;
+
+                //If same move exists then merge
+                for (ExpEntryEx* temp = first; temp != last; ++temp)
+                {
+                    if (temp->move == exp->move)
+                    {
+                        temp->merge(exp);
+                        return false;
+                    }
+                }
+
+                if (_size == MaxMoves)
+                    return false;
+
+                //Different move: insert based on pseudo-quality. It goes in front of the first move
+                //it is better than if that is the best move, and right after it otherwise
+                ExpEntryEx* pos = first;
+                while (pos != last && exp->compare(pos) <= 0)
+                    ++pos;
+
+                if (pos != first && pos != last)
+                    ++pos;
+
+                memmove((void*)(pos + 1), (const void*)pos, (last - pos) * sizeof(ExpEntryEx));
+                new (pos) ExpEntryEx(exp->key, (Move)exp->move, (Value)exp->value, (Depth)exp->depth, exp->count);
+                _size++;
+
+                return true;
+            }
+
+            //Write the block to 'head', which must have room for size() entries
+            void write(ExpEntryEx* head) const
+            {
+                memcpy((void*)head, _moves, _size * sizeof(ExpEntryEx));
+                for (size_t i = 0; i < _size; ++i)
+                    head[i].set_has_next(i + 1 < _size);
+            }
+        };
+
+        //Counts are scaled down when saving all the experience so that they keep fitting their field
+        uint16_t count_scale(const ExpEntryEx* exp)
+        {
+            uint16_t maxCount = numeric_limits<uint8_t>::min();
+            for (; exp; exp = exp->next())
+                maxCount = max(maxCount, exp->count);
+
+            return 1 + maxCount / 128;
+        }
+
+        ////////////////////////////////////////////////////////////////
+        // ExpShards
+        ////////////////////////////////////////////////////////////////
+        //Position key to head of its move list. The positions are split over several maps
+        //by the high bits of their keys, so that each map can be filled by its own thread
+        class ExpShards
+        {
+        public:
+            static constexpr int    ShardBits = 6;
+            static constexpr size_t ShardCount = size_t(1) << ShardBits;
+
+            static size_t shard_of(Key k)
+            {
+                return k >> (64 - ShardBits);
+            }
+
+        private:
+            ExpMap _shards[ShardCount];
+
+        public:
+            ExpMap& shard(size_t i)
+            {
+                return _shards[i];
+            }
+
+            //Location of the list head of 'k', nullptr if the position is not known
+            ExpEntryEx** find(Key k)
+            {
+                ExpMap& map = _shards[shard_of(k)];
+                ExpIterator itr = map.find(k);
+
+                return itr == map.end() ? nullptr : &itr->second;
+            }
+
+            const ExpEntryEx* get(Key k) const
+            {
+                const ExpMap& map = _shards[shard_of(k)];
+                ExpConstIterator itr = map.find(k);
+
+                return itr == map.end() ? nullptr : itr->second;
+            }
+
+            bool contains(Key k) const
+            {
+                return get(k) != nullptr;
+            }
+
+            void insert(ExpEntryEx* head)
+            {
+                _shards[shard_of(head->key)][head->key] = head;
+            }
+
+            size_t size() const
+            {
+                size_t n = 0;
+                for (const ExpMap& map : _shards)
+                    n += map.size();
+
+                return n;
+            }
+
+            bool empty() const
+            {
+                for (const ExpMap& map : _shards)
+                    if (!map.empty())
+                        return false;
+
+                return true;
+            }
+
+            void clear()
+            {
+                for (ExpMap& map : _shards)
+                    map.clear();
+            }
+
+            //Call 'f' with the head of every move list
+            template<typename F> void for_each(F f) const
+            {
+                for (const ExpMap& map : _shards)
+                    for (auto& x : map)
+                        f(x.second);
+            }
+        };
+
+        ////////////////////////////////////////////////////////////////
+        // ExpIndex
+        ////////////////////////////////////////////////////////////////
+        //Read-optimized open addressing index used by probe(). It maps a position key
+        //to the head of its move list (which is kept sorted, best move first)
+        //
+        //Every bucket is exactly one cache line and holds the low 32 bits of the keys
+        //next to the list heads (the bucket itself is selected by the high bits of the key).
+        //A miss is answered from a single cache line and a hit needs only one more
+        //line: the head entry, which is also the best experience move of the position.
+        //The bucket also keeps the depth of the deepest move of each position, so that
+        //positions without a deep enough move are rejected without reading their list
+        //
+        //List heads are stored relative to a base address. For in-memory experience the
+        //base is zero, for indexed experience files it is the start of the file mapping
+        class ExpIndex
+        {
+        public:
+            static constexpr int BucketSize = 4;
+
+            //The best move of a list is kept inline, so that it is known without reading the list. Its value
+            //takes the high bits of the reference, locations of list heads (pointers or file offsets) fit in 48 bits
+            struct Bucket
+            {
+                uint32_t key32[BucketSize];    //16 bytes
+                uint64_t ref[BucketSize];      //32 bytes (location of the list head, zero if the slot is empty, and best value)
+                uint8_t  maxDepth[BucketSize]; // 4 bytes (deepest move of the list plus one, zero if unknown)
+                uint16_t bestMove[BucketSize]; // 8 bytes (best move of the list, MOVE_NONE if unknown)
+                uint8_t  bestDepth[BucketSize];// 4 bytes (depth of the best move)
+            };
+
+            static_assert(sizeof(Bucket) == 64);
+
+            static constexpr int      RefBits = 48;
+            static constexpr uint64_t RefMask = (1ULL << RefBits) - 1;
+
+            //What a bucket keeps of a list besides its location
+            struct ListInfo
+            {
+                uint8_t  depthTag;
+                uint16_t bestMove;
+                int16_t  bestValue;
+                uint8_t  bestDepth;
+            };
+
+            //Depth kept in a bucket for a list. Rounded up, so that a list is never rejected because of it
+            static uint8_t depth_tag(Depth maxDepth)
+            {
+                return (uint8_t)std::clamp(maxDepth + 1, 1, 255);
+            }
+
+            //'best' is the head of the list, unless the head is left out of an indexed file
+            static ListInfo list_info(Depth maxDepth, const ExpEntryEx* best)
+            {
+                //A best move deeper than a byte is left to the list
+                if (best->depth < 0 || best->depth > 255)
+                    return ListInfo{ depth_tag(maxDepth), MOVE_NONE, 0, 0 };
+
+                return ListInfo{ depth_tag(maxDepth), (uint16_t)best->move, (int16_t)best->value, (uint8_t)best->depth };
+            }
+
+            static ListInfo list_info(const ExpEntryEx* head)
+            {
+                Depth d = head->depth;
+                for (const ExpEntryEx* temp = head->next(); temp; temp = temp->next())
+                    d = std::max(d, (Depth)temp->depth);
+
+                return list_info(d, head);
+            }
+
+        private:
+            static constexpr size_t MinBucketCount = 1024;
+
+            Bucket*   _buckets;
+            size_t    _bucketCount;
+            size_t    _size;
+            uintptr_t _base;
+            bool      _owned;
+            bool      _failed;
+
+        private:
+            ExpEntryEx* entry(uint64_t ref) const
+            {
+                return reinterpret_cast<ExpEntryEx*>(_base + (ref & RefMask));
+            }
+
+            static void set_slot(Bucket& b, int i, uint64_t ref, const ListInfo& info)
+            {
+                assert(ref && ref <= RefMask);
+
+                b.ref[i] = ref | (uint64_t)(uint16_t)info.bestValue << RefBits;
+                b.maxDepth[i] = info.depthTag;
+                b.bestMove[i] = info.bestMove;
+                b.bestDepth[i] = info.bestDepth;
+            }
+
+            static ListInfo slot_info(const Bucket& b, int i)
+            {
+                return ListInfo{ b.maxDepth[i], b.bestMove[i], (int16_t)(b.ref[i] >> RefBits), b.bestDepth[i] };
+            }
+
+            //Insert or update a list head in the given table. Returns true if a new key was added
+            //If 'unique' is true then the key is known not to be in the table and lists are never dereferenced
+            bool set_in(Bucket* buckets, size_t bucketCount, Key k, uint64_t ref, const ListInfo& info, bool unique) const
+            {
+                const uint32_t key32 = (uint32_t)k;
+
+                size_t idx = mul_hi64(k, bucketCount);
+                while (true)
+                {
+                    Bucket& b = buckets[idx];
+                    for (int i = 0; i < BucketSize; ++i)
+                    {
+                        if (!b.ref[i])
+                        {
+                            b.key32[i] = key32;
+                            set_slot(b, i, ref, info);
+                            return true;
+                        }
+
+                        if (!unique && b.key32[i] == key32 && entry(b.ref[i])->key == k)
+                        {
+                            set_slot(b, i, ref, info);
+                            return false;
+                        }
+                    }
+
+                    if (++idx == bucketCount)
+                        idx = 0;
+                }
+            }
+
+            bool resize(size_t bucketCount)
+            {
+                assert(_owned || !_buckets);
+
+                Bucket* buckets = (Bucket*)aligned_large_pages_alloc(bucketCount * sizeof(Bucket));
+                if (!buckets)
+                {
+                    sync_cout << "info string Failed to allocate " << format_bytes(bucketCount * sizeof(Bucket), 2) << " for experience index. Falling back to hash map lookups" << sync_endl;
+                    return false;
+                }
+
+                memset((void*)buckets, 0, bucketCount * sizeof(Bucket));
+
+                //Rehash existing entries
+                for (size_t i = 0; i < _bucketCount; ++i)
+                    for (int j = 0; j < BucketSize && _buckets[i].ref[j]; ++j)
+                        set_in(buckets, bucketCount, entry(_buckets[i].ref[j])->key, _buckets[i].ref[j] & RefMask, slot_info(_buckets[i], j), true);
+
+                aligned_large_pages_free(_buckets);
+
+                _buckets = buckets;
+                _bucketCount = bucketCount;
+                _owned = true;
+
+                return true;
+            }
+
+        public:
+            ExpIndex() : _buckets(nullptr), _bucketCount(0), _size(0), _base(0), _owned(false), _failed(false) {}
+
+            ~ExpIndex()
+            {
+                clear();
+            }
+
+            //False if the index could not be allocated, in which case the caller should use its own map
+            bool valid() const
+            {
+                return !_failed;
+            }
+
+            void clear()
+            {
+                if (_owned)
+                    aligned_large_pages_free(_buckets);
+
+                _buckets = nullptr;
+                _bucketCount = 0;
+                _size = 0;
+                _base = 0;
+                _owned = false;
+                _failed = false;
+            }
+
+            //Use an existing (read-only) table, whose references are relative to 'base'
+            void attach(const Bucket* buckets, size_t bucketCount, size_t size, const void* base)
+            {
+                clear();
+
+                _buckets = const_cast<Bucket*>(buckets);
+                _bucketCount = bucketCount;
+                _size = size;
+                _base = reinterpret_cast<uintptr_t>(base);
+            }
+
+            //Make this index a copy of 'other' in its own memory, which is placed on the NUMA node of the calling thread
+            bool copy(const ExpIndex& other)
+            {
+                clear();
+
+                if (other._bucketCount)
+                {
+                    Bucket* buckets = (Bucket*)aligned_large_pages_alloc(other._bucketCount * sizeof(Bucket));
+                    if (!buckets)
+                        return false;
+
+                    memcpy((void*)buckets, other._buckets, other._bucketCount * sizeof(Bucket));
+
+                    _buckets = buckets;
+                    _owned = true;
+                }
+
+                _bucketCount = other._bucketCount;
+                _size = other._size;
+                _base = other._base;
+                _failed = other._failed;
+
+                return true;
+            }
+
+            //Number of buckets of a table reserved for 'size' keys
+            static size_t bucket_count_for(size_t size)
+            {
+                return std::max(MinBucketCount, (size * 2 + BucketSize - 1) / BucketSize);
+            }
+
+            //Allocate an empty table for 'size' keys which will be added with insert()
+            bool reserve(size_t size)
+            {
+                clear();
+
+                if (resize(bucket_count_for(size)))
+                    return true;
+
+                _failed = true;
+                return false;
+            }
+
+            //Add a key which is known not to be in the index yet, without growing the table
+            void insert(Key k, uint64_t ref, const ListInfo& info)
+            {
+                assert(_owned && (_size + 1) * 2 <= _bucketCount * BucketSize);
+
+                set_in(_buckets, _bucketCount, k, ref, info, true);
+                ++_size;
+            }
+
+            //False if a list at this location cannot be indexed
+            static bool indexable(const ExpEntryEx* head)
+            {
+                return reinterpret_cast<uintptr_t>(head) <= RefMask;
+            }
+
+            //Add a new position or replace the head of the move list of an existing one
+            void set(ExpEntryEx* head)
+            {
+                assert(_owned || !_buckets);
+
+                if (_failed)
+                    return;
+
+                if (!indexable(head))
+                {
+                    clear();
+                    _failed = true;
+                    return;
+                }
+
+                //Keep the load factor at or below 50% so that misses rarely need a second bucket
+                if ((_size + 1) * 2 > _bucketCount * BucketSize)
+                {
+                    if (!resize(std::max(MinBucketCount, _bucketCount * 2)))
+                    {
+                        clear();
+                        _failed = true;
+                        return;
+                    }
+                }
+
+                if (set_in(_buckets, _bucketCount, head->key, reinterpret_cast<uintptr_t>(head), list_info(head), false))
+                    ++_size;
+            }
+
+            ExpEntryEx* find(Key k) const
+            {
+                bool shallow;
+                return find(k, std::numeric_limits<Depth>::min(), shallow);
+            }
+
+            //Same as find(), but a position without a move of at least 'minDepth' is rejected from the bucket alone:
+            //'shallow' is set and nullptr returned. The low 32 bits of the key are trusted for that, a false match
+            //only hides experience and needs a key with the same 32 bits in the same bucket
+            ExpEntryEx* find(Key k, Depth minDepth, bool& shallow) const
+            {
+                shallow = false;
+                if (!_size)
+                    return nullptr;
+
+                const uint32_t key32 = (uint32_t)k;
+
+                size_t idx = mul_hi64(k, _bucketCount);
+                while (true)
+                {
+                    const Bucket& b = _buckets[idx];
+                    for (int i = 0; i < BucketSize; ++i)
+                    {
+                        //Slots are filled in order and never deleted, so the first empty slot ends the search
+                        if (!b.ref[i])
+                            return nullptr;
+
+                        if (b.key32[i] != key32)
+                            continue;
+
+                        if (b.maxDepth[i] && b.maxDepth[i] - 1 < minDepth)
+                        {
+                            shallow = true;
+                            return nullptr;
+                        }
+
+                        if (entry(b.ref[i])->key == k)
+                            return entry(b.ref[i]);
+                    }
+
+                    if (++idx == _bucketCount)
+                        idx = 0;
+                }
+            }
+
+            static void set_best(const ExpEntryEx* exp, ExpBest& best)
+            {
+                best = ExpBest{ (Move)exp->move, (Value)exp->value, (Depth)exp->depth };
+            }
+
+            //Best move of position 'k'. It is read from the bucket when it is kept there, trusting the low
+            //32 bits of the key as find() does for shallow positions, otherwise from the head of the list
+            bool find_best(Key k, ExpBest& best) const
+            {
+                if (!_size)
+                    return false;
+
+                const uint32_t key32 = (uint32_t)k;
+
+                size_t idx = mul_hi64(k, _bucketCount);
+                while (true)
+                {
+                    const Bucket& b = _buckets[idx];
+                    for (int i = 0; i < BucketSize; ++i)
+                    {
+                        if (!b.ref[i])
+                            return false;
+
+                        if (b.key32[i] != key32)
+                            continue;
+
+                        if (b.bestMove[i] != MOVE_NONE)
+                        {
+                            best = ExpBest{ (Move)b.bestMove[i], (Value)(int16_t)(b.ref[i] >> RefBits), (Depth)b.bestDepth[i] };
+                            return true;
+                        }
+
+                        if (entry(b.ref[i])->key == k)
+                        {
+                            set_best(entry(b.ref[i]), best);
+                            return true;
+                        }
+                    }
+
+                    if (++idx == _bucketCount)
+                        idx = 0;
+                }
+            }
+
+            //Start loading the bucket where the search for 'k' begins
+            void prefetch(Key k) const
+            {
+                if (_size)
+                    Stockfish::prefetch((void*)&_buckets[mul_hi64(k, _bucketCount)]);
+            }
+
+            //Call 'f' with the head of every indexed move list
+            template<typename F> void for_each(F f) const
+            {
+                for (size_t i = 0; i < _bucketCount; ++i)
+                    for (int j = 0; j < BucketSize && _buckets[i].ref[j]; ++j)
+                        f(entry(_buckets[i].ref[j]));
+            }
+
+            const Bucket* data() const
+            {
+                return _buckets;
+            }
+
+            size_t bucket_count() const
+            {
+                return _bucketCount;
+            }
+        };
+
+        ////////////////////////////////////////////////////////////////
+        // ExpFilter
+        ////////////////////////////////////////////////////////////////
+        //Register-blocked Bloom filter placed in front of the index. All the bits of
+        //a key live in the same 64-bit word, so rejecting a position which is not in
+        //the experience file costs a single memory access into a table which is much
+        //smaller than the index (and hence much more likely to stay in cache)
+        class ExpFilter
+        {
+        private:
+            static constexpr size_t BitsPerKey = 12;
+            static constexpr int    NumHashes = 4;
+            static constexpr size_t MinCapacity = 4096;
+
+            //Used when no filter could be allocated: every key 'may' be present
+            static inline uint64_t AllSet = ~0ULL;
+
+            uint64_t* _words;
+            size_t    _wordCount;
+            size_t    _capacity;
+            size_t    _size;
+            bool      _owned;
+            bool      _failed;
+
+        private:
+            static uint64_t mask_of(Key k)
+            {
+                uint64_t m = 0;
+                for (int i = 0; i < NumHashes; ++i)
+                    m |= 1ULL << ((k >> (6 * i)) & 63);
+
+                return m;
+            }
+
+            void release()
+            {
+                if (_owned)
+                    aligned_large_pages_free(_words);
+
+                _words = &AllSet;
+                _wordCount = 1;
+                _capacity = 0;
+                _size = 0;
+                _owned = false;
+            }
+
+        public:
+            ExpFilter() : _words(&AllSet), _wordCount(1), _capacity(0), _size(0), _owned(false), _failed(false) {}
+
+            ~ExpFilter()
+            {
+                release();
+            }
+
+            //(Re)allocate an empty filter sized for 'capacity' keys
+            bool init(size_t capacity)
+            {
+                release();
+
+                capacity = std::max(capacity, MinCapacity);
+                size_t wordCount = capacity * BitsPerKey / 64;
+                uint64_t* words = (uint64_t*)aligned_large_pages_alloc(wordCount * sizeof(uint64_t));
+                if (!words)
+                {
+                    sync_cout << "info string Failed to allocate " << format_bytes(wordCount * sizeof(uint64_t), 2) << " for experience prefilter" << sync_endl;
+
+                    _failed = true;
+                    return false;
+                }
+
+                memset((void*)words, 0, wordCount * sizeof(uint64_t));
+
+                _words = words;
+                _wordCount = wordCount;
+                _capacity = capacity;
+                _owned = true;
+
+                return true;
+            }
+
+            //Make this filter a copy of 'other' in its own memory, which is placed on the NUMA node of the calling thread
+            bool copy(const ExpFilter& other)
+            {
+                clear();
+
+                if (other._words == &AllSet)
+                    return true;
+
+                uint64_t* words = (uint64_t*)aligned_large_pages_alloc(other._wordCount * sizeof(uint64_t));
+                if (!words)
+                    return false;
+
+                memcpy((void*)words, other._words, other._wordCount * sizeof(uint64_t));
+
+                _words = words;
+                _wordCount = other._wordCount;
+                _capacity = other._capacity;
+                _size = other._size;
+                _owned = true;
+
+                return true;
+            }
+
+            //Use an existing (read-only) filter
+            void attach(const uint64_t* words, size_t wordCount)
+            {
+                clear();
+
+                _words = const_cast<uint64_t*>(words);
+                _wordCount = wordCount;
+            }
+
+            void clear()
+            {
+                release();
+                _failed = false;
+            }
+
+            //True if more keys would push the false positive rate above the one the filter was sized for
+            bool full() const
+            {
+                return !_failed && _size >= _capacity;
+            }
+
+            void add(Key k)
+            {
+                if (!_owned)
+                    return;
+
+                _words[mul_hi64(k, _wordCount)] |= mask_of(k);
+                ++_size;
+            }
+
+            bool may_contain(Key k) const
+            {
+                const uint64_t m = mask_of(k);
+                return (_words[mul_hi64(k, _wordCount)] & m) == m;
+            }
+
+            //Expected false positive rate given the actual fill of the filter
+            double false_positive_rate() const
+            {
+                if (_words == &AllSet)
+                    return 1.0;
+
+                double sum = 0.0;
+                for (size_t i = 0; i < _wordCount; ++i)
+                    sum += std::pow(popcount(_words[i]) / 64.0, NumHashes);
+
+                return sum / _wordCount;
+            }
+
+            const uint64_t* data() const
+            {
+                return _words;
+            }
+
+            size_t word_count() const
+            {
+                return _wordCount;
+            }
+        };
+
+        ////////////////////////////////////////////////////////////////
+        // ExpMapping
+        ////////////////////////////////////////////////////////////////
+        //Indexed (V3) experience file mapped in memory. Its prefilter, index and move
+        //lists are used in place: nothing is parsed or copied, so the experience is
+        //available as soon as the file is mapped and the pages are shared by all the
+        //engine processes using the same file
+        class ExpMapping
+        {
+        private:
+            Utility::FileMapping _file;
+            ExpIndex             _index;
+            ExpFilter            _filter;
+            V3::Header           _header;
+
+        public:
+            ExpMapping()
+            {
+                memset((void*)&_header, 0, sizeof(_header));
+            }
+
+            bool map(const string& fn)
+            {
+                unmap();
+
+                if (!_file.map(Utility::map_path(fn), true))
+                    return false;
+
+                const unsigned char* data = _file.data();
+                memcpy((void*)&_header, data + V3::HeaderOffset, sizeof(_header));
+
+                //The reader already checked the signature and the tail, check the rest of the layout here
+                if (   _header.filterOffset != V3::DataOffset + _header.records * sizeof(ExpEntryEx)
+                    || _header.filterOffset % sizeof(uint64_t) || !_header.filterWords
+                    || _header.indexOffset < _header.filterOffset + _header.filterWords * sizeof(uint64_t)
+                    || _header.indexOffset % sizeof(ExpIndex::Bucket)
+                    || _header.positions * 2 > _header.bucketCount * ExpIndex::BucketSize
+                    || _header.tailOffset != _header.indexOffset + _header.bucketCount * sizeof(ExpIndex::Bucket)
+                    || _header.tailOffset > _file.data_size())
+                {
+                    sync_cout << "info string The indexed experience file [" << fn << "] is corrupted" << sync_endl;
+
+                    unmap();
+                    return false;
+                }
+
+                _filter.attach(reinterpret_cast<const uint64_t*>(data + _header.filterOffset), _header.filterWords);
+                _index.attach(reinterpret_cast<const ExpIndex::Bucket*>(data + _header.indexOffset), _header.bucketCount, _header.positions, data);
+
+                return true;
+            }
+
+            void unmap()
+            {
+                _index.clear();
+                _filter.clear();
+                _file.unmap();
+
+                memset((void*)&_header, 0, sizeof(_header));
+            }
+
+            bool has_data() const
+            {
+                return _file.has_data();
+            }
+
+            size_t positions() const
+            {
+                return _header.positions;
+            }
+
+            size_t records() const
+            {
+                return _header.records;
+            }
+
+            double false_positive_rate() const
+            {
+                return _header.filterFprPpm / 1000000.0;
+            }
+
+            const ExpEntryEx* find(Key k) const
+            {
+                if (!_filter.may_contain(k))
+                    return nullptr;
+
+                return _index.find(k);
+            }
+
+            const ExpEntryEx* find(Key k, Depth minDepth, bool& shallow) const
+            {
+                shallow = false;
+                if (!_filter.may_contain(k))
+                    return nullptr;
+
+                return _index.find(k, minDepth, shallow);
+            }
+
+            bool find_best(Key k, ExpBest& best) const
+            {
+                return _filter.may_contain(k) && _index.find_best(k, best);
+            }
+
+            void prefetch(Key k) const
+            {
+                if (_filter.may_contain(k))
+                    _index.prefetch(k);
+            }
+
+            const ExpIndex& index() const
+            {
+                return _index;
+            }
+
+            const ExpFilter& filter() const
+            {
+                return _filter;
+            }
+
+            //Move records of the file, in position order
+            const ExpEntryEx* record_data() const
+            {
+                return reinterpret_cast<const ExpEntryEx*>(_file.data() + V3::DataOffset);
+            }
+
+            const unsigned char* data() const
+            {
+                return _file.data();
+            }
+
+            template<typename F> void for_each(F f) const
+            {
+                _index.for_each(f);
+            }
+        };
+
+        ////////////////////////////////////////////////////////////////
+        // ExpReplica
+        ////////////////////////////////////////////////////////////////
+        //Copy of the prefilters and indexes (in memory and mapped) placed on one NUMA node, so that
+        //the search threads running on that node probe local memory. The move lists are not copied:
+        //a probe only reaches them on a hit, while the prefilter and the index are read at every node
+        struct ExpReplica
+        {
+            ExpIndex  index;
+            ExpFilter filter;
+            ExpIndex  mappedIndex;
+            ExpFilter mappedFilter;
+
+            bool copy(const ExpIndex& i, const ExpFilter& f, const ExpMapping& mapping)
+            {
+                return    index.copy(i)
+                       && filter.copy(f)
+                       && mappedIndex.copy(mapping.index())
+                       && mappedFilter.copy(mapping.filter());
+            }
+
+            const ExpEntryEx* find_mapped(Key k, Depth minDepth, bool& shallow) const
+            {
+                shallow = false;
+                return mappedFilter.may_contain(k) ? mappedIndex.find(k, minDepth, shallow) : nullptr;
+            }
+
+            bool find_mapped_best(Key k, ExpBest& best) const
+            {
+                return mappedFilter.may_contain(k) && mappedIndex.find_best(k, best);
+            }
+
+            size_t memory_size() const
+            {
+                return   (index.bucket_count() + mappedIndex.bucket_count()) * sizeof(ExpIndex::Bucket)
+                       + (filter.word_count() + mappedFilter.word_count()) * sizeof(uint64_t);
+            }
+        };
+
+        //NUMA node of the current search thread, or -1 if it does not use a replica
+        thread_local int searchThreadNode = -1;
+
+        ////////////////////////////////////////////////////////////////
+        // ExpArena
+        ////////////////////////////////////////////////////////////////
+        //All the experience entries of an ExperienceData are carved out of large chunks,
+        //which are only released all together: freeing millions of entries costs a few
+        //calls to the allocator. The move lists replaced by new ones are only released then
+        class ExpArena
+        {
+        private:
+            static constexpr size_t ChunkEntries = 64 * 1024; //2 MB
+
+            vector<ExpEntryEx*> _chunks;
+            ExpEntryEx*         _next;
+            size_t              _free;
+
+        public:
+            ExpArena() : _next(nullptr), _free(0) {}
+
+            ~ExpArena()
+            {
+                clear();
+            }
+
+            //Storage for 'count' contiguous entries, nullptr if it could not be allocated
+            ExpEntryEx* allocate(size_t count)
+            {
+                if (count > _free)
+                {
+                    size_t chunkEntries = std::max(count, ChunkEntries);
+                    ExpEntryEx* chunk = (ExpEntryEx*)aligned_large_pages_alloc(chunkEntries * sizeof(ExpEntryEx));
+                    if (!chunk)
+                    {
+                        sync_cout << "info string Failed to allocate " << format_bytes(chunkEntries * sizeof(ExpEntryEx), 2) << " for experience data" << sync_endl;
+                        return nullptr;
+                    }
+
+                    _chunks.push_back(chunk);
+
+                    //Bulk allocations get a chunk of their own, the current chunk is kept for the small ones
+                    if (count >= ChunkEntries)
+                        return chunk;
+
+                    _next = chunk;
+                    _free = ChunkEntries;
+                }
+
+                ExpEntryEx* exp = _next;
+                _next += count;
+                _free -= count;
+
+                return exp;
+            }
+
+            ExpEntryEx* create(Key k, Move m, Value v, Depth d, uint16_t c)
+            {
+                ExpEntryEx* exp = allocate(1);
+                return exp ? new (exp) ExpEntryEx(k, m, v, d, c) : nullptr;
+            }
+
+            //Take over the chunks of 'other', whose entries are then released with the ones of this arena
+            void adopt(ExpArena& other)
+            {
+                _chunks.insert(_chunks.end(), other._chunks.begin(), other._chunks.end());
+
+                other._chunks.clear();
+                other._next = nullptr;
+                other._free = 0;
+            }
+
+            void clear()
+            {
+                for (ExpEntryEx* chunk : _chunks)
+                    aligned_large_pages_free(chunk);
+
+                _chunks.clear();
+                _next = nullptr;
+                _free = 0;
+            }
+        };
+
+        bool compact_journal(const string& expFilename, const string& journalFilename);
+
+        class ExperienceData
+        {
+        private:
+            string              _filename;
+
+            ExpArena            _arena;
+            vector<ExpEntryEx*> _newPvExp;
+            vector<ExpEntryEx*> _newMultiPvExp;
+
+            ExpShards           _mainExp;
+            ExpIndex            _index;
+            ExpFilter           _filter;
+
+            ExpMapping          _mapping;
+
+            size_t                                _nodeCount;
+            unique_ptr<atomic<ExpReplica*>[]>     _replicas;
+            mutex                                 _replicasMutex;
+
+            size_t              _promotedPositions;
+            ExpPositionBuilder  _builder;
+            int                 _saveVersion;
+            atomic<int64_t>     _fileTime; //Experience file as last loaded or saved by the engine
+            atomic<size_t>      _fileSize;
+
+            bool                _loading;
+            atomic<bool>        _abortLoading;
+            atomic<bool>        _loadingResult;
+            thread              *_loaderThread;
+            condition_variable  _loadingCond;
+            mutex               _loaderMutex;
+
+            thread              _compactorThread;
+            atomic<bool>        _compacting;
+
+        private:
+            void clear()
+            {
+                //Make sure we are not loading an experience file
+                _abortLoading.store(true, memory_order_relaxed);
+                wait_for_load_finished();
+                assert(_loaderThread == nullptr);
+
+                //Let a running journal compaction finish (it only works on files)
+                if (_compactorThread.joinable())
+                    _compactorThread.join();
+
+                //Clear new exp
+                clear_new_exp();
+
+                //Clear
+                drop_replicas();
+                _mainExp.clear();
+                _index.clear();
+                _filter.clear();
+
+                //Free all experience data
+                _arena.clear();
+
+                //Unmap indexed experience (after the lists pointing into it are gone)
+                _mapping.unmap();
+                _promotedPositions = 0;
+
+                experience_changed();
+            }
+
+            void clear_new_exp()
+            {
+                //Their moves are already in the experience data and the entries are owned by the arena
+                _newPvExp.clear();
+                _newMultiPvExp.clear();
+            }
+
+            //Add a new position to the index and the prefilter, or update the location of its move list
+            void index_position(ExpEntryEx* head, bool newPosition)
+            {
+                _index.set(head);
+
+                //Replicas are updated the same way, unless the index was reallocated
+                for_each_replica([&](ExpReplica* replica)
+                    {
+                        if (replica->index.bucket_count() != _index.bucket_count() || replica->index.valid() != _index.valid())
+                            return false;
+
+                        replica->index.set(head);
+                        return true;
+                    });
+
+                if (!newPosition)
+                    return;
+
+                if (_filter.full())
+                    rebuild_filter(_mainExp.size() * 2);
+                else
+                {
+                    _filter.add(head->key);
+                    for_each_replica([&](ExpReplica* replica)
+                        {
+                            replica->filter.add(head->key);
+                            return true;
+                        });
+                }
+            }
+
+            //Call 'f' with every replica, which is dropped if 'f' returns false. Not to be used while searching
+            template<typename F> void for_each_replica(F f)
+            {
+                for (size_t node = 0; node < _nodeCount; ++node)
+                {
+                    ExpReplica* replica = _replicas[node].load(memory_order_relaxed);
+                    if (replica && !f(replica))
+                    {
+                        _replicas[node].store(nullptr, memory_order_relaxed);
+                        delete replica;
+                    }
+                }
+            }
+
+            //Replica used by the current search thread, nullptr if it probes the shared structures
+            const ExpReplica* thread_replica() const
+            {
+                return searchThreadNode >= 0 ? _replicas[searchThreadNode].load(memory_order_acquire) : nullptr;
+            }
+
+            //Merge moves into position 'k': its move list is rebuilt by 'add' as a new block, which
+            //replaces the current one. Positions of a memory mapped experience file are read-only,
+            //so a mapped position gets a copy in memory, which shadows the mapped one
+            //The index and the prefilter are left to the caller, so that several threads can update
+            //positions of different shards, each with its own builder and arena. Returns the new block
+            template<typename F> ExpEntryEx* merge_moves(Key k, ExpPositionBuilder& builder, ExpArena& arena, size_t& promoted, F add)
+            {
+                ExpEntryEx** current = _mainExp.find(k);
+                const ExpEntryEx* mapped = current ? nullptr : _mapping.find(k);
+
+                builder.assign(current ? *current : mapped);
+                add(builder);
+
+                ExpEntryEx* head = arena.allocate(builder.size());
+                if (!head)
+                    return nullptr;
+
+                builder.write(head);
+
+                if (current)
+                    *current = head;
+                else
+                {
+                    _mainExp.insert(head);
+                    promoted += mapped != nullptr;
+                }
+
+                return head;
+            }
+
+            bool link_entry(const ExpEntryEx* exp)
+            {
+                position_changed(exp->key);
+
+                //If the same move is already in memory then merge in place
+                ExpEntryEx** head = _mainExp.find(exp->key);
+                ExpEntryEx* exp2 = head ? (*head)->find(exp->move) : nullptr;
+                if (exp2)
+                {
+                    //The move may get deeper
+                    exp2->merge(exp);
+                    index_position(*head, false);
+                    return false;
+                }
+
+                bool linked = false;
+                ExpEntryEx* newHead = merge_moves(exp->key, _builder, _arena, _promotedPositions, [&](ExpPositionBuilder& builder)
+                    {
+                        linked = builder.add(exp);
+                    });
+
+                if (!newHead)
+                    return false;
+
+                index_position(newHead, !head);
+                return linked;
+            }
+
+            void rebuild_filter(size_t capacity)
+            {
+                drop_replicas();
+
+                if (!_filter.init(capacity))
+                    return;
+
+                _mainExp.for_each([&](const ExpEntryEx* head)
+                    {
+                        _filter.add(head->key);
+                    });
+            }
+
+            //Positions in memory plus the mapped ones which are not shadowed by a copy in memory
+            size_t positions_count() const
+            {
+                return _mainExp.size() + _mapping.positions() - _promotedPositions;
+            }
+
+            double false_positive_rate() const
+            {
+                return _mapping.has_data() ? _mapping.false_positive_rate() : _filter.false_positive_rate();
+            }
+
+            //Call 'f' with the head of the move list of every position, in memory or mapped
+            template<typename F> void for_each_position(F f) const
+            {
+                _mainExp.for_each(f);
+
+                _mapping.for_each([&](const ExpEntryEx* head)
+                    {
+                        if (!_mainExp.contains(head->key))
+                            f(head);
+                    });
+            }
+
+            void rebuild_index()
+            {
+                drop_replicas();
+                _index.clear();
+                if (!_index.reserve(_mainExp.size()))
+                    return;
+
+                _mainExp.for_each([&](ExpEntryEx* head)
+                    {
+                        _index.insert(head->key, reinterpret_cast<uintptr_t>(head), ExpIndex::list_info(head));
+                    });
+            }
+
+            //Read the entries of a file and merge them into the experience data. The file is read
+            //in batches of chunks: first the threads read the chunks of a batch and sort their entries
+            //by shard, then each thread merges all the entries of a shard, position by position. The
+            //entries of a position are merged in file order, so the result does not depend on the
+            //number of threads. The positions are merged in key order, which is the worst order to
+            //fill the index with, so the index and the prefilter are rebuilt at the end instead
+            bool load_entries(const string& fn, ExperienceReader* reader, size_t expCount, size_t filterCapacity, size_t& duplicateMoves)
+            {
+                const size_t chunkCount = (expCount + LoadChunkSize - 1) / LoadChunkSize;
+                const size_t threadCount = std::min((size_t)std::max(thread::hardware_concurrency(), 1U), chunkCount);
+                const size_t batchSize = std::min(threadCount * LoadChunkSize, expCount);
+
+                struct Loader
+                {
+                    ExpPositionBuilder builder;
+                    ExpArena           arena;
+                    ifstream           in;
+                    size_t             promoted = 0;
+                    size_t             duplicates = 0;
+
+                    //Entries of the shard being merged (key and offset), sorted by position and then in file order
+                    vector<pair<Key, uint32_t>> order;
+
+                    //Entries read by this loader in the current batch, by shard, as offsets from the start of the batch
+                    vector<uint32_t>   shards[ExpShards::ShardCount];
+                };
+
+                vector<Loader> loaders(threadCount);
+
+                ExpArena batchArena;
+                ExpEntryEx* batch = batchArena.allocate(batchSize);
+                if (!batch)
+                    return false;
+
+                atomic<size_t> nextWork(0);
+                atomic<size_t> progress(0);
+                atomic<bool>   failed(false);
+
+                //Both steps count for half of the progress
+                auto report_progress = [&](size_t count)
+                {
+                    if (expCount < LoadProgressMinEntries)
+                        return;
+
+                    size_t done = progress.fetch_add(count, memory_order_relaxed);
+                    size_t before = done * 10 / (2 * expCount);
+                    size_t after = (done + count) * 10 / (2 * expCount);
+                    if (after != before)
+                        sync_cout << "info string Loading experience file [" << fn << "]: " << after * 10 << "%" << sync_endl;
+                };
+
+                auto run_threads = [&](auto work)
+                {
+                    nextWork.store(0, memory_order_relaxed);
+
+                    if (threadCount == 1)
+                    {
+                        work(loaders[0]);
+                        return;
+                    }
+
+                    vector<thread> threads;
+                    for (size_t t = 0; t < threadCount; ++t)
+                        threads.emplace_back([&, t]() { work(loaders[t]); });
+
+                    for (thread& th : threads)
+                        th.join();
+                };
+
+                auto stopped = [&]()
+                {
+                    return failed.load(memory_order_relaxed) || _abortLoading.load(memory_order_relaxed);
+                };
+
+                for (size_t batchFirst = 0; batchFirst < expCount && !stopped(); batchFirst += batchSize)
+                {
+                    const size_t batchCount = std::min(batchSize, expCount - batchFirst);
+                    const size_t batchChunks = (batchCount + LoadChunkSize - 1) / LoadChunkSize;
+
+                    //Step 1: Read chunks
+                    run_threads([&](Loader& loader)
+                        {
+                            if (!loader.in.is_open())
+                                loader.in.open(Utility::map_path(fn), ios::in | ios::binary);
+
+                            size_t chunk;
+                            while ((chunk = nextWork.fetch_add(1, memory_order_relaxed)) < batchChunks && !stopped())
+                            {
+                                size_t first = chunk * LoadChunkSize;
+                                size_t count = std::min(LoadChunkSize, batchCount - first);
+
+                                if (!loader.in.is_open() || !reader->read_range(loader.in, batchFirst + first, count, &batch[first]))
+                                {
+                                    sync_cout << "info string Failed to read experience entries #" << batchFirst + first + 1 << " to #" << batchFirst + first + count << " of " << expCount << sync_endl;
+                                    failed.store(true, memory_order_relaxed);
+                                    return;
+                                }
+
+                                for (size_t i = first; i < first + count; ++i)
+                                    loader.shards[ExpShards::shard_of(batch[i].key)].push_back((uint32_t)i);
+
+                                report_progress(count);
+                            }
+                        });
+
+                    if (stopped())
+                        break;
+
+                    //Step 2: Merge shards
+                    run_threads([&](Loader& loader)
+                        {
+                            size_t shard;
+                            while ((shard = nextWork.fetch_add(1, memory_order_relaxed)) < ExpShards::ShardCount && !stopped())
+                            {
+                                //Group the entries by position, keeping the file order
+                                vector<pair<Key, uint32_t>>& order = loader.order;
+                                order.clear();
+
+                                for (Loader& l : loaders)
+                                {
+                                    for (uint32_t i : l.shards[shard])
+                                        order.emplace_back(batch[i].key, i);
+
+                                    l.shards[shard].clear();
+                                }
+
+                                sort(order.begin(), order.end());
+
+                                for (size_t i = 0, j; i < order.size(); i = j)
+                                {
+                                    const Key k = order[i].first;
+                                    for (j = i + 1; j < order.size() && order[j].first == k; ++j) {}
+
+                                    ExpEntryEx* head = merge_moves(k, loader.builder, loader.arena, loader.promoted, [&](ExpPositionBuilder& builder)
+                                        {
+                                            for (size_t x = i; x < j; ++x)
+                                                loader.duplicates += !builder.add(&batch[order[x].second]);
+                                        });
+
+                                    if (!head)
+                                    {
+                                        failed.store(true, memory_order_relaxed);
+                                        return;
+                                    }
+                                }
+
+                                report_progress(order.size());
+                            }
+                        });
+                }
+
+                //The new move lists are owned by the experience data from now on
+                for (Loader& loader : loaders)
+                {
+                    _arena.adopt(loader.arena);
+                    _promotedPositions += loader.promoted;
+                    duplicateMoves += loader.duplicates;
+                }
+
+                experience_changed();
+
+                rebuild_index();
+                rebuild_filter(filterCapacity);
+
+                return !stopped();
+            }
+
+            bool _load(string fn)
+            {
+                ifstream in(Utility::map_path(fn), ios::in | ios::binary | ios::ate);
+                if (!in.is_open())
+                {
+                    sync_cout << "info string Could not open experience file: " << fn << sync_endl;
+                    return false;
+                }
+
+                size_t inSize = in.tellg();
+                if (inSize == 0)
+                {
+                    sync_cout << "info string The experience file [" << fn << "] is empty" << sync_endl;
+                    return false;
+                }
+
+                ExpReaders expReaders;
+                ExperienceReader* reader = expReaders.find(in, inSize);
+
+                if (!reader)
+                {
+                    sync_cout << "info string The file [" << fn << "] is not a valid experience file" << sync_endl;
+                    return false;
+                }
+
+                if (reader->get_version() < Current::ExperienceVersion)
+                    sync_cout << "info string Importing experience version (" << reader->get_version() << ") from file [" << fn << "]" << sync_endl;
+
+                //The first loaded file decides the format of a full save
+                if (_mainExp.empty() && !_mapping.has_data() && reader->get_version() >= Current::ExperienceVersion)
+                    _saveVersion = reader->get_version();
+
+                //Few variables to be used for statistical information
+                size_t prevPosCount = positions_count();
+                size_t duplicateMoves = 0;
+                size_t mappedCount = 0;
+
+                //Indexed file: map it if nothing else is loaded, otherwise merge its records
+                if (reader->get_version() == V3::ExperienceVersion)
+                {
+                    if (prevPosCount == 0)
+                    {
+                        drop_replicas();
+                        if (!_mapping.map(fn))
+                            return false;
+
+                        mappedCount = _mapping.records();
+                        experience_changed();
+                    }
+                    else
+                    {
+                        ExpMapping mapping;
+                        if (!mapping.map(fn))
+                            return false;
+
+                        //The index is rebuilt here, the prefilter with the entries which follow the indexed data
+                        bool success = true;
+                        mapping.for_each([&](const ExpEntryEx* head)
+                            {
+                                success = success && merge_moves(head->key, _builder, _arena, _promotedPositions, [&](ExpPositionBuilder& builder)
+                                    {
+                                        for (const ExpEntryEx* temp = head; temp; temp = temp->next())
+                                            duplicateMoves += !builder.add(temp);
+                                    });
+                            });
+
+                        rebuild_index();
+                        experience_changed();
+
+                        if (!success)
+                            return false;
+
+                        mappedCount = mapping.records();
+                    }
+                }
+
+                //Size the prefilter for the worst case where every entry is a new position
+                size_t expCount = reader->entries_count();
+                size_t filterCapacity = _mainExp.size() + expCount;
+
+                //Load experience entries (the index and the prefilter are rebuilt once they are merged)
+                if (!expCount)
+                    rebuild_filter(filterCapacity);
+                else if (!load_entries(fn, reader, expCount, filterCapacity, duplicateMoves))
+                    return false;
+
+                //Close input file
+                in.close();
+
+                expCount += mappedCount;
+
+                //Stop if aborted
+                if (_abortLoading.load(memory_order_relaxed))
+                    return false;
+
+                if (reader->get_version() < Current::ExperienceVersion)
+                {
+                    sync_cout << "info string Upgrading experience file (" << fn << ") from version (" << reader->get_version() << ") to version (" << Current::ExperienceVersion << ")" << sync_endl;
+                    save(fn, true, true);
+                }
+
+                //Stop if aborted
+                if (_abortLoading.load(memory_order_relaxed))
+                    return false;
+
+                //Show some statistics
+                if (prevPosCount)
+                {
+                    sync_cout
+                        << "info string " << fn << " -> Total new moves: " << expCount
+                        << ". Total new positions: " << (positions_count() - prevPosCount)
+                        << ". Duplicate moves: " << duplicateMoves
+                        << ". Prefilter FPR: " << setprecision(2) << fixed << 100.0 * false_positive_rate() << "%"
+                        << sync_endl;
+                }
+                else
+                {
+                    sync_cout
+                        << "info string " << fn << " -> Total moves: " << expCount
+                        << ". Total positions: " << positions_count()
+                        << ". Duplicate moves: " << duplicateMoves
+                        << ". Fragmentation: " << setprecision(2) << fixed << 100.0 * (double)duplicateMoves / (double)expCount << "%"
+                        << ". Prefilter FPR: " << 100.0 * false_positive_rate() << "%"
+                        << sync_endl;
+                }
+
+                return true;
+            }
+
+            //Write all the experience as an indexed (V3) file: the move lists, followed by
+            //the prefilter and the index, laid out so that the file can be used in place
+            bool _save_indexed(string fn)
+            {
+                ofstream out(Utility::map_path(fn), ios::out | ios::binary | ios::trunc);
+                if (!out.is_open())
+                {
+                    sync_cout << "info string Failed to open experience file [" << fn << "] for writing" << sync_endl;
+                    return false;
+                }
+
+                //Signature, the header is written last
+                string preamble(V3::DataOffset, '\0');
+                preamble.replace(0, V3::ExperienceSignature.length(), V3::ExperienceSignature);
+                out.write(preamble.data(), preamble.size());
+
+                vector<char> writeBuffer;
+                writeBuffer.reserve(WriteBufferSize);
+
+                auto write_data = [&](const void* data, size_t size, bool force) -> bool
+                {
+                    const char* p = reinterpret_cast<const char*>(data);
+                    writeBuffer.insert(writeBuffer.end(), p, p + size);
+
+                    if (force || writeBuffer.size() >= WriteBufferSize)
+                    {
+                        out.write(writeBuffer.data(), writeBuffer.size());
+                        writeBuffer.clear();
+                    }
+
+                    return (bool)out;
+                };
+
+                //Step 1: Move lists. Keep the position of every list head for the index
+                V3::Header header;
+                memset((void*)&header, 0, sizeof(header));
+
+                struct Head
+                {
+                    Key               key;
+                    uint64_t          ref;
+                    Depth             maxDepth;
+                    const ExpEntryEx* best; //First record written for the position
+                };
+
+                vector<Head> heads;
+                heads.reserve(positions_count());
+
+                bool success = true;
+                for_each_position([&](const ExpEntryEx* exp)
+                    {
+                        if (!success)
+                            return;
+
+                        uint16_t scale = count_scale(exp);
+                        size_t moves = 0;
+                        Depth maxDepth = EXP_MIN_DEPTH;
+                        const ExpEntryEx* best = nullptr;
+                        for (const ExpEntryEx* temp = exp; temp; temp = temp->next())
+                            if (temp->depth >= EXP_MIN_DEPTH)
+                            {
+                                if (!moves)
+                                    best = temp;
+
+                                moves++;
+                                maxDepth = std::max(maxDepth, (Depth)temp->depth);
+                            }
+
+                        if (!moves)
+                            return;
+
+                        heads.push_back({ exp->key, V3::DataOffset + header.records * sizeof(ExpEntryEx), maxDepth, best });
+
+                        for (const ExpEntryEx* temp = exp; temp; temp = temp->next())
+                        {
+                            if (temp->depth < EXP_MIN_DEPTH)
+                                continue;
+
+                            //Records of a position are contiguous
+                            ExpEntryEx e(temp->key, (Move)temp->move, (Value)temp->value, (Depth)temp->depth, max(temp->count / scale, 1));
+                            e.set_has_next(--moves != 0);
+
+                            header.records++;
+                            if (!write_data(&e, sizeof(e), false))
+                            {
+                                success = false;
+                                return;
+                            }
+                        }
+                    });
+
+                //Step 2: Prefilter
+                ExpFilter filter;
+                ExpIndex index;
+                if (success && (!filter.init(heads.size()) || !index.reserve(heads.size())))
+                    success = false;
+
+                if (success)
+                {
+                    for (const Head& h : heads)
+                    {
+                        filter.add(h.key);
+                        index.insert(h.key, h.ref, ExpIndex::list_info(h.maxDepth, h.best));
+                    }
+
+                    header.positions = heads.size();
+                    header.filterOffset = V3::DataOffset + header.records * sizeof(ExpEntryEx);
+                    header.filterWords = filter.word_count();
+                    header.filterFprPpm = (uint64_t)(filter.false_positive_rate() * 1000000.0);
+
+                    success = write_data(filter.data(), filter.word_count() * sizeof(uint64_t), false);
+                }
+
+                //Step 3: Index, aligned to its bucket size
+                if (success)
+                {
+                    size_t offset = header.filterOffset + header.filterWords * sizeof(uint64_t);
+                    size_t padding = (sizeof(ExpIndex::Bucket) - offset % sizeof(ExpIndex::Bucket)) % sizeof(ExpIndex::Bucket);
+                    const char zeros[sizeof(ExpIndex::Bucket)] = {};
+
+                    header.indexOffset = offset + padding;
+                    header.bucketCount = index.bucket_count();
+                    header.tailOffset = header.indexOffset + header.bucketCount * sizeof(ExpIndex::Bucket);
+
+                    success =    write_data(zeros, padding, false)
+                              && write_data(index.data(), index.bucket_count() * sizeof(ExpIndex::Bucket), true);
+                }
+
+                //Step 4: Header
+                if (success)
+                {
+                    out.seekp(V3::HeaderOffset);
+                    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                    success = (bool)out;
+                }
+
+                if (!success)
+                {
+                    sync_cout << "info string Failed to save indexed experience file [" << fn << "]" << sync_endl;
+                    return false;
+                }
+
+                sync_cout << "info string Saved " << header.positions << " position(s) and " << header.records << " moves to indexed experience file: " << fn << sync_endl;
+
+                //Clear new moves
+                clear_new_exp();
+
+                return true;
+            }
+
+            //Write all the experience as a compressed (V4) file, position by position in key order
+            bool _save_compressed(string fn)
+            {
+                V4::Writer writer;
+                if (!writer.open(Utility::map_path(fn)))
+                {
+                    sync_cout << "info string Failed to open experience file [" << fn << "] for writing" << sync_endl;
+                    return false;
+                }
+
+                vector<const ExpEntryEx*> heads;
+                heads.reserve(positions_count());
+                for_each_position([&](const ExpEntryEx* exp)
+                    {
+                        heads.push_back(exp);
+                    });
+
+                sort(heads.begin(), heads.end(), [](const ExpEntryEx* a, const ExpEntryEx* b) { return a->key < b->key; });
+
+                bool success = true;
+                for (const ExpEntryEx* exp : heads)
+                {
+                    uint16_t scale = count_scale(exp);
+                    for (; exp && success; exp = exp->next())
+                    {
+                        if (exp->depth < EXP_MIN_DEPTH)
+                            continue;
+
+                        Current::ExpEntry e(exp->key, (Move)exp->move, (Value)exp->value, (Depth)exp->depth, max(exp->count / scale, 1));
+                        success = writer.write(e);
+                    }
+                }
+
+                if (!success || !writer.close())
+                {
+                    sync_cout << "info string Failed to save compressed experience file [" << fn << "]" << sync_endl;
+                    return false;
+                }
+
+                sync_cout << "info string Saved " << writer.positions() << " position(s) and " << writer.records() << " moves to compressed experience file: " << fn << sync_endl;
+
+                //Clear new moves
+                clear_new_exp();
+
+                return true;
+            }
+
+            bool _save(string fn, bool saveAll)
+            {
+                fstream out;
+                out.open(Utility::map_path(fn), ios::out | ios::binary | ios::app);
+                if (!out.is_open())
+                {
+                    sync_cout << "info string Failed to open experience file [" << fn << "] for writing" << sync_endl;
+                    return false;
+                }
+
+                //If this is a new file then we need to write the signature first
+                out.seekg(0, out.end);
+                size_t length = out.tellg();
+                out.seekg(0, out.beg);
+
+                if (length == 0)
+                {
+                    out.seekp(0, out.beg);
+
+                    out << Current::ExperienceSignature;
+                    if (!out)
+                    {
+                        sync_cout << "info string Failed to write signature to experience file [" << fn << "]" << sync_endl;
+                        return false;
+                    }
+                }
+
+                //Reposition writing pointer to end of file
+                out.seekp(ios::end);
+
+                vector<char> writeBuffer;
+                writeBuffer.reserve(WriteBufferSize);
+
+                auto write_entry = [&](const Current::ExpEntry* exp, bool force) -> bool
+                {
+                    if (exp)
+                    {
+                        const char* data = reinterpret_cast<const char*>(exp);
+                        writeBuffer.insert(writeBuffer.end(), data, data + sizeof(Current::ExpEntry));
+                    }
+
+                    bool success = true;
+                    if (force || writeBuffer.size() >= WriteBufferSize)
+                    {
+                        out.write(writeBuffer.data(), writeBuffer.size());
+                        if (!out)
+                            success = false;
+
+                        writeBuffer.clear();
+                    }
+
+                    return success;
+                };
+
+                size_t allMoves = 0;
+                size_t allPositions = 0;
+                if (saveAll)
+                {
+                    bool success = true;
+                    for_each_position([&](const ExpEntryEx* exp)
+                        {
+                            if (!success)
+                                return;
+
+                            allPositions++;
+
+                            //Scale counts
+                            uint16_t scale = count_scale(exp);
+
+                            //Save
+                            for (; exp; exp = exp->next())
+                            {
+                                if (exp->depth < EXP_MIN_DEPTH)
+                                    continue;
+
+                                Current::ExpEntry e(exp->key, (Move)exp->move, (Value)exp->value, (Depth)exp->depth, max(exp->count / scale, 1));
+
+                                allMoves++;
+                                if (!write_entry(&e, false))
+                                {
+                                    sync_cout << "info string Failed to save experience entry to experience file [" << fn << "]" << sync_endl;
+                                    success = false;
+                                    return;
+                                }
+                            }
+                        });
+
+                    if (!success)
+                        return false;
+
+                    sync_cout << "info string Saved " << allPositions << " position(s) and " << allMoves << " moves to experience file: " << fn << sync_endl;
+                }
+                else
+                {
+                    for (auto &newExp : { _newPvExp, _newMultiPvExp })
+                    {
+                        for (const ExpEntryEx* exp : newExp)
+                        {
+                            if (exp->depth < EXP_MIN_DEPTH)
+                                continue;
+
+                            if (!write_entry(exp, false))
+                            {
+                                sync_cout << "info string Failed to save experience entry to experience file [" << fn << "]" << sync_endl;
+                                return false;
+                            }
+                        }
+                    }
+
+                    sync_cout << "info string Saved " << _newPvExp.size() << " PV and " << _newMultiPvExp.size() << " MultiPV entries to experience file: " << fn << sync_endl;
+                }
+
+                //Flush buffer
+                write_entry(nullptr, true);
+
+                //Clear new moves
+                clear_new_exp();
+
+                return true;
+            }
+
+        public:
+            ExperienceData()
+            {
+                _loading = false;
+                _abortLoading.store(false, memory_order_relaxed);
+                _loadingResult.store(false, memory_order_relaxed);
+                _loaderThread = nullptr;
+                _compacting.store(false, memory_order_relaxed);
+                _promotedPositions = 0;
+                _saveVersion = Current::ExperienceVersion;
+                _fileTime.store(0, memory_order_relaxed);
+                _fileSize.store(0, memory_order_relaxed);
+
+                _nodeCount = WinProcGroup::node_count();
+                _replicas = make_unique<atomic<ExpReplica*>[]>(_nodeCount);
+                for (size_t node = 0; node < _nodeCount; ++node)
+                    _replicas[node].store(nullptr, memory_order_relaxed);
+            }
+
+            ~ExperienceData()
+            {
+                clear();
+            }
+
+        public:
+
+            string filename() const
+            {
+                return _filename;
+            }
+
+            //In journal mode new experience is appended to a small separate file, which is merged
+            //into the experience file by a background thread once it has grown large enough
+            static string journal_filename(const string& fn)
+            {
+                return fn + ".journal";
+            }
+
+            //Journal being merged into the experience file
+            static string sealed_journal_filename(const string& fn)
+            {
+                return fn + ".journal.sealed";
+            }
+
+            void save_journal(string fn)
+            {
+                wait_for_load_finished();
+
+                if (!has_new_exp())
+                    return;
+
+                string journal = journal_filename(fn);
+                if (!_save(journal, false))
+                    return;
+
+                //Compact once the journal is large compared to the experience file
+                string expFilename = Utility::map_path(fn);
+                size_t expSize = Utility::file_exists(expFilename) ? Utility::get_file_size(expFilename) : 0;
+                if (Utility::get_file_size(Utility::map_path(journal)) < std::max(JournalMinCompactionSize, expSize / JournalCompactionRatio))
+                    return;
+
+                if (_compacting.load(memory_order_acquire))
+                    return;
+
+                if (_compactorThread.joinable())
+                    _compactorThread.join();
+
+                //Changes made by others are still detected once the compacted file replaces the experience file
+                bool ownFile = Utility::is_same_file(fn, _filename) && !file_changed();
+
+                //Seal the journal: new experience goes to a new one while the sealed journal is merged
+                //A sealed journal left by an interrupted compaction is merged first
+                string sealedJournal = Utility::map_path(sealed_journal_filename(fn));
+                if (!Utility::file_exists(sealedJournal) && rename(Utility::map_path(journal).c_str(), sealedJournal.c_str()) != 0)
+                    return;
+
+                _compacting.store(true, memory_order_release);
+                _compactorThread = thread([this, expFilename, sealedJournal, ownFile]()
+                    {
+                        if (compact_journal(expFilename, sealedJournal) && ownFile)
+                            record_file_stamp();
+
+                        _compacting.store(false, memory_order_release);
+                    });
+            }
+
+            void set_save_version(int version)
+            {
+                _saveVersion = version;
+            }
+
+            bool has_new_exp() const
+            {
+                return _newPvExp.size() || _newMultiPvExp.size();
+            }
+
+            //'journals': also load the journals of the experience file (see save_journal())
+            bool load(string filename, bool synchronous, bool journals = false)
+            {
+                //Make sure we are not already in the process of loading same/other experience file
+                wait_for_load_finished();
+
+                //Load requested experience file
+                _filename = filename;
+                record_file_stamp();
+                _loadingResult.store(false, memory_order_relaxed);
+
+                //Block
+                {
+                    _loading = true;
+                    lock_guard<mutex> lg1(_loaderMutex);
+                    _loaderThread = new thread(thread([this, filename, journals]()
+                        {
+                            //Load
+                            bool loadingResult = _load(filename);
+
+                            //Load the journals (sealed one first), if any
+                            if (journals)
+                            {
+                                for (const string& journal : { sealed_journal_filename(filename), journal_filename(filename) })
+                                    if (!_abortLoading.load(memory_order_relaxed) && Utility::file_exists(Utility::map_path(journal)))
+                                        loadingResult = _load(journal) || loadingResult;
+                            }
+
+                            _loadingResult.store(loadingResult, memory_order_relaxed);
+
+                            //Copy pointer of loader thread so that we can
+                            //clear the variable now and and deleted later
+                            thread *t = _loaderThread;
+                            _loaderThread = nullptr;
+
+                            //Notify
+                            {
+                                lock_guard<mutex> lg2(_loaderMutex);
+                                _loading = false;
+                                _loadingCond.notify_one();
+                            }
+                            
+                            //Detach and delete loader thread
+                            t->detach();
+                            delete t;
+                        }));
+                }
+
+                return synchronous ? wait_for_load_finished() : true;
+            }
+
+            bool wait_for_load_finished()
+            {
+                unique_lock<mutex> ul(_loaderMutex);
+                _loadingCond.wait(ul, [&] { return !_loading; });
+                return loading_result();
+            }
+
+            bool loading_result() const
+            {
+                return _loadingResult.load(memory_order_relaxed);
+            }
+
+            //Stop a background load as soon as possible, which then fails
+            void abort_loading()
+            {
+                _abortLoading.store(true, memory_order_relaxed);
+            }
+
+            void record_file_stamp()
+            {
+                _fileTime.store(Utility::get_file_time(_filename), memory_order_relaxed);
+                _fileSize.store(Utility::get_file_size(_filename), memory_order_relaxed);
+            }
+
+            //True if the experience file was modified since it was loaded, other than by the engine saving to it
+            bool file_changed() const
+            {
+                return   Utility::get_file_time(_filename) != _fileTime.load(memory_order_relaxed)
+                      || Utility::get_file_size(_filename) != _fileSize.load(memory_order_relaxed);
+            }
+
+            //Take over the experience learned by 'other' and not saved yet
+            void adopt_new_exp(const ExperienceData& other)
+            {
+                for (const ExpEntryEx* exp : other._newPvExp)
+                    add_pv_experience(exp->key, (Move)exp->move, (Value)exp->value, (Depth)exp->depth);
+
+                for (const ExpEntryEx* exp : other._newMultiPvExp)
+                    add_multipv_experience(exp->key, (Move)exp->move, (Value)exp->value, (Depth)exp->depth);
+            }
+
+            void save(string fn, bool saveAll, bool ignoreLoadingCheck)
+            {
+                //Make sure we are not already in the process of loading same/other experience file
+                if(!ignoreLoadingCheck)
+                    wait_for_load_finished();
+
+                if (!has_new_exp() && (!saveAll || positions_count() == 0))
+                    return;
+
+                //Saving to the loaded file is not a change to reload it for, unless it was already changed by others
+                bool ownFile = Utility::is_same_file(fn, _filename) && !file_changed();
+
+                //Step 1: Create backup only if 'saveAll' is 'true'
+                string expFilename = Utility::map_path(fn);
+                string backupExpFilename;
+                if (saveAll && Utility::file_exists(expFilename))
+                {
+                    backupExpFilename = expFilename + ".bak";
+
+                    //If backup file already exists then delete it
+                    if (Utility::file_exists(backupExpFilename))
+                    {
+                        if (remove(backupExpFilename.c_str()) != 0)
+                        {
+                            sync_cout << "info string Could not deleted existing backup file: " << backupExpFilename << sync_endl;
+
+                            //Clear backup filename
+                            backupExpFilename.clear();
+                        }
+                    }
+
+                    //Rename current experience file
+                    if (!backupExpFilename.empty())
+                    {
+                        if (rename(expFilename.c_str(), backupExpFilename.c_str()) != 0)
+                        {
+                            sync_cout << "info string Could not create backup of current experience file" << sync_endl;
+
+                            //Clear backup filename
+                            backupExpFilename.clear();
+                        }
+                    }
+                }
+
+                //A mapped experience file must not be overwritten while it is in use
+                if (saveAll && _saveVersion == V3::ExperienceVersion && _mapping.has_data() && backupExpFilename.empty() && Utility::file_exists(expFilename))
+                {
+                    sync_cout << "info string Could not save indexed experience file [" << fn << "] while it is mapped" << sync_endl;
+                    return;
+                }
+
+                //Step 2: Save
+                bool saved;
+                if (saveAll && _saveVersion == V3::ExperienceVersion)
+                    saved = _save_indexed(fn);
+                else if (saveAll && _saveVersion == V4::ExperienceVersion)
+                    saved = _save_compressed(fn);
+                else
+                    saved = _save(fn, saveAll);
+
+                if (!saved)
+                {
+                    //Step 2a: Restore backup in case of failure while saving
+                    if (!backupExpFilename.empty())
+                    {
+                        if (rename(backupExpFilename.c_str(), expFilename.c_str()) != 0)
+                        {
+                            sync_cout << "info string Could not restore backup experience file: " << backupExpFilename << sync_endl;
+                        }
+                    }
+                }
+                else if (ownFile)
+                    record_file_stamp();
+            }
+
+            //Replicate the prefilters and indexes on the NUMA node of the calling search thread, and make the
+            //thread use them. The replica is built by the first thread of the node (memory is placed on the node
+            //of the thread which first touches it), and is kept up to date by the changes made between searches
+            void attach_search_thread(bool replicate)
+            {
+                searchThreadNode = -1;
+
+                int node = WinProcGroup::current_node();
+                if (!replicate || _nodeCount < 2 || node < 0 || (size_t)node >= _nodeCount)
+                    return;
+
+                lock_guard<mutex> lock(_replicasMutex);
+                if (!_replicas[node].load(memory_order_relaxed))
+                {
+                    ExpReplica* replica = new (nothrow) ExpReplica();
+                    if (!replica || !replica->copy(_index, _filter, _mapping))
+                    {
+                        sync_cout << "info string Failed to replicate experience index on NUMA node " << node << sync_endl;
+
+                        delete replica;
+                        return;
+                    }
+
+                    _replicas[node].store(replica, memory_order_release);
+                    sync_cout << "info string Replicated experience index on NUMA node " << node << " (" << format_bytes(replica->memory_size(), 2) << ")" << sync_endl;
+                }
+
+                searchThreadNode = node;
+            }
+
+            void drop_replicas()
+            {
+                for_each_replica([](ExpReplica*)
+                    {
+                        return false;
+                    });
+            }
+
+            //Move list of position 'k', nullptr if it has none or if none of its moves has a depth of at least 'minDepth'.
+            //The moves of the returned list still need to be checked against 'minDepth'
+            const ExpEntryEx* probe(Key k, Depth minDepth = std::numeric_limits<Depth>::min()) const
+            {
+                const ExpReplica* replica = thread_replica();
+                const ExpFilter& filter = replica ? replica->filter : _filter;
+                const ExpIndex& index = replica ? replica->index : _index;
+                bool shallow;
+
+                //Most positions have no experience: reject them before touching the index
+                if (filter.may_contain(k))
+                {
+                    if (index.valid())
+                    {
+                        const ExpEntryEx* exp = index.find(k, minDepth, shallow);
+                        if (exp || shallow)
+                            return exp;
+                    }
+                    else
+                    {
+                        const ExpEntryEx* exp = _mainExp.get(k);
+                        if (exp)
+                        {
+                            assert(exp->key == k);
+                            return exp;
+                        }
+                    }
+                }
+
+                //Positions which were not updated since the indexed experience file was mapped
+                return replica ? replica->find_mapped(k, minDepth, shallow) : _mapping.find(k, minDepth, shallow);
+            }
+
+            //Same lookups as probe(), but the best move is read from the index buckets when they keep it
+            bool probe_best(Key k, ExpBest& best) const
+            {
+                const ExpReplica* replica = thread_replica();
+                const ExpFilter& filter = replica ? replica->filter : _filter;
+                const ExpIndex& index = replica ? replica->index : _index;
+
+                if (filter.may_contain(k))
+                {
+                    if (index.valid())
+                    {
+                        if (index.find_best(k, best))
+                            return true;
+                    }
+                    else
+                    {
+                        const ExpEntryEx* exp = _mainExp.get(k);
+                        if (exp)
+                        {
+                            assert(exp->key == k);
+                            ExpIndex::set_best(exp, best);
+                            return true;
+                        }
+                    }
+                }
+
+                return replica ? replica->find_mapped_best(k, best) : _mapping.find_best(k, best);
+            }
+
+            //Only the index buckets are prefetched: the prefilter is small enough to stay in cache, and
+            //checking it first avoids loading buckets for the positions which have no experience
+            void prefetch(Key k) const
+            {
+                const ExpReplica* replica = thread_replica();
+                if (replica)
+                {
+                    if (replica->filter.may_contain(k))
+                        replica->index.prefetch(k);
+
+                    if (replica->mappedFilter.may_contain(k))
+                        replica->mappedIndex.prefetch(k);
+
+                    return;
+                }
+
+                if (_filter.may_contain(k))
+                    _index.prefetch(k);
+
+                _mapping.prefetch(k);
+            }
+
+            void add_pv_experience(Key k, Move m, Value v, Depth d)
+            {
+                ExpEntryEx* exp = _arena.create(k, m, v, d, 1);
+
+                if (exp)
+                {
+                    _newPvExp.emplace_back(exp);
+                    link_entry(exp);
+                }
+            }
+
+            void add_multipv_experience(Key k, Move m, Value v, Depth d)
+            {
+                ExpEntryEx* exp = _arena.create(k, m, v, d, 1);
+
+                if (exp)
+                {
+                    _newMultiPvExp.emplace_back(exp);
+                    link_entry(exp);
+                }
+            }
+        };
+
+        ////////////////////////////////////////////////////////////////
+        // ExpRunMerger
+        ////////////////////////////////////////////////////////////////
+        //Defragments and merges experience files which do not fit in memory (external sort).
+        //The entries of the input files are collected in runs of bounded size, which are sorted
+        //by key and written to temporary files. The runs are then merged: all the entries of a
+        //position come out together and in input order, and are merged and written exactly as
+        //ExperienceData does it in memory
+        class ExpRunMerger
+        {
+        private:
+            string             _target;
+            int                _version;
+            size_t             _runCapacity;
+            size_t             _runSize;
+            ExpEntryEx*        _run;
+            vector<string>     _runFiles;
+            ExpPositionBuilder _builder;
+
+            //Pruning of the merged positions
+            Depth              _minDepth;
+            int                _minCount;
+            size_t             _maxMoves;
+            const vector<Key>* _positions;
+
+            alignas(ExpEntryEx) unsigned char _position[ExpPositionBuilder::MaxMoves * sizeof(ExpEntryEx)];
+
+        private:
+            ExpEntryEx* next_entry()
+            {
+                if (_runSize == _runCapacity && !flush_run())
+                    return nullptr;
+
+                return new (&_run[_runSize++]) ExpEntryEx((Key)0, MOVE_NONE, (Value)0, (Depth)0, 0);
+            }
+
+            //Up to 'count' consecutive entries of the current run. 'count' is set to the number of entries returned
+            ExpEntryEx* next_entries(size_t& count)
+            {
+                if (_runSize == _runCapacity && !flush_run())
+                    return nullptr;
+
+                count = std::min(count, _runCapacity - _runSize);
+                for (size_t i = 0; i < count; ++i)
+                    new (&_run[_runSize + i]) ExpEntryEx((Key)0, MOVE_NONE, (Value)0, (Depth)0, 0);
+
+                _runSize += count;
+                return &_run[_runSize - count];
+            }
+
+            //Sort the current run by key, keeping the order of the entries of a position, and write it to a temporary file
+            bool flush_run()
+            {
+                if (!_runSize)
+                    return true;
+
+                vector<uint32_t> order(_runSize);
+                for (size_t i = 0; i < _runSize; ++i)
+                    order[i] = (uint32_t)i;
+
+                auto less = [&](uint32_t a, uint32_t b)
+                {
+                    return _run[a].key != _run[b].key ? _run[a].key < _run[b].key : a < b;
+                };
+
+                //Sort slices of the run in parallel, then merge them two by two
+                size_t slices = std::clamp<size_t>(thread::hardware_concurrency(), 1, std::max<size_t>(_runSize / (64 * 1024), 1));
+                vector<size_t> bounds(slices + 1);
+                for (size_t i = 0; i <= slices; ++i)
+                    bounds[i] = _runSize * i / slices;
+
+                vector<thread> threads;
+                for (size_t i = 1; i < slices; ++i)
+                    threads.emplace_back([&, i]() { sort(order.begin() + bounds[i], order.begin() + bounds[i + 1], less); });
+
+                sort(order.begin(), order.begin() + bounds[1], less);
+
+                for (thread& th : threads)
+                    th.join();
+
+                for (size_t width = 1; width < slices; width *= 2)
+                {
+                    threads.clear();
+                    for (size_t i = 0; i + width < slices; i += 2 * width)
+                    {
+                        auto first = order.begin() + bounds[i];
+                        auto middle = order.begin() + bounds[i + width];
+                        auto last = order.begin() + bounds[std::min(i + 2 * width, slices)];
+                        threads.emplace_back([=]() { inplace_merge(first, middle, last, less); });
+                    }
+
+                    for (thread& th : threads)
+                        th.join();
+                }
+
+                string runFile = _target + ".run" + to_string(_runFiles.size());
+                ofstream out(runFile, ios::out | ios::binary | ios::trunc);
+                _runFiles.push_back(runFile);
+
+                vector<char> writeBuffer;
+                writeBuffer.reserve(WriteBufferSize);
+
+                for (uint32_t i : order)
+                {
+                    const char* data = reinterpret_cast<const char*>(static_cast<const Current::ExpEntry*>(&_run[i]));
+                    writeBuffer.insert(writeBuffer.end(), data, data + sizeof(Current::ExpEntry));
+
+                    if (writeBuffer.size() >= WriteBufferSize)
+                    {
+                        out.write(writeBuffer.data(), writeBuffer.size());
+                        writeBuffer.clear();
+                    }
+                }
+
+                out.write(writeBuffer.data(), writeBuffer.size());
+                if (!out)
+                {
+                    sync_cout << "info string Failed to write temporary experience file [" << runFile << "]" << sync_endl;
+                    return false;
+                }
+
+                _runSize = 0;
+                return true;
+            }
+
+            void remove_runs()
+            {
+                for (const string& runFile : _runFiles)
+                    remove(runFile.c_str());
+
+                _runFiles.clear();
+            }
+
+            //Write the merged runs to the target file. Returns false (after removing the partial file) on failure
+            bool write_target(size_t& allPositions, size_t& allMoves, size_t& duplicateMoves)
+            {
+                //Positions come out in key order, as the compressed format needs them
+                V4::Writer compressed;
+                ofstream out;
+                bool success;
+                if (_version == V4::ExperienceVersion)
+                    success = compressed.open(_target);
+                else
+                {
+                    out.open(_target, ios::out | ios::binary | ios::trunc);
+                    out << Current::ExperienceSignature;
+                    success = (bool)out;
+                }
+
+                vector<char> writeBuffer;
+                writeBuffer.reserve(WriteBufferSize);
+
+                auto write_entry = [&](const Current::ExpEntry* exp, bool force) -> bool
+                {
+                    if (!success)
+                        return false;
+
+                    if (_version == V4::ExperienceVersion)
+                        return success = exp ? compressed.write(*exp) : compressed.close();
+
+                    if (exp)
+                    {
+                        const char* data = reinterpret_cast<const char*>(exp);
+                        writeBuffer.insert(writeBuffer.end(), data, data + sizeof(Current::ExpEntry));
+                    }
+
+                    if (force || writeBuffer.size() >= WriteBufferSize)
+                    {
                         out.write(writeBuffer.data(), writeBuffer.size());
-                        if (!out)
-                            success = false;
+                        writeBuffer.clear();
+                    }
+
+                    return success = (bool)out;
+                };
+
+                //Run readers: each one keeps a part of its run in memory
+                struct RunReader
+                {
+                    ifstream     in;
+                    vector<char> buffer;
+                    size_t       pos = 0;
+                    size_t       size = 0;
+
+                    const Current::ExpEntry* peek() const
+                    {
+                        return pos < size ? reinterpret_cast<const Current::ExpEntry*>(&buffer[pos * sizeof(Current::ExpEntry)]) : nullptr;
+                    }
+
+                    void advance()
+                    {
+                        if (++pos < size)
+                            return;
+
+                        in.read(buffer.data(), buffer.size());
+                        size = in.gcount() / sizeof(Current::ExpEntry);
+                        pos = 0;
+                    }
+                };
+
+                size_t bufferEntries = std::max(_runCapacity * sizeof(ExpEntryEx) / std::max(_runFiles.size(), (size_t)1), (size_t)64 * 1024) / sizeof(Current::ExpEntry);
+                vector<RunReader> runs(_runFiles.size());
+
+                //Smallest key first, then earliest run, so that the entries of a position keep the input order
+                typedef pair<Key, size_t> RunHead;
+                priority_queue<RunHead, vector<RunHead>, greater<RunHead>> heads;
+
+                for (size_t i = 0; i < runs.size(); ++i)
+                {
+                    runs[i].in.open(_runFiles[i], ios::in | ios::binary);
+                    runs[i].buffer.resize(bufferEntries * sizeof(Current::ExpEntry));
+                    runs[i].pos = runs[i].size = 0;
+                    runs[i].advance();
+
+                    if (runs[i].peek())
+                        heads.emplace(runs[i].peek()->key, i);
+                }
+
+                ExpEntryEx* head = reinterpret_cast<ExpEntryEx*>(_position);
+                vector<Key>::const_iterator nextPosition;
+                if (_positions)
+                    nextPosition = _positions->begin();
+
+                while (success && !heads.empty())
+                {
+                    const Key key = heads.top().first;
+
+                    //Merge all the entries of the position
+                    _builder.assign(nullptr);
+                    while (!heads.empty() && heads.top().first == key)
+                    {
+                        size_t runIdx = heads.top().second;
+                        RunReader& run = runs[runIdx];
+                        heads.pop();
+
+                        for (const Current::ExpEntry* e = run.peek(); e && e->key == key; run.advance(), e = run.peek())
+                            duplicateMoves += !_builder.add(e);
+
+                        if (run.peek())
+                            heads.emplace(run.peek()->key, runIdx);
+                    }
+
+                    _builder.write(head);
+
+                    //Positions to keep, if only some of them are kept. Both lists are sorted by key
+                    if (_positions)
+                    {
+                        while (nextPosition != _positions->end() && *nextPosition < key)
+                            ++nextPosition;
+
+                        if (nextPosition == _positions->end() || *nextPosition != key)
+                            continue;
+                    }
+
+                    //The best moves which pass the thresholds. The moves keep their order, the best one is first
+                    const ExpEntryEx* kept[ExpPositionBuilder::MaxMoves];
+                    size_t keptCount = 0;
+                    for (const ExpEntryEx* exp = head; exp; exp = exp->next())
+                        if (exp->depth >= std::max(EXP_MIN_DEPTH, _minDepth) && exp->count >= _minCount)
+                            kept[keptCount++] = exp;
+
+                    if (keptCount > _maxMoves)
+                    {
+                        uint8_t best[ExpPositionBuilder::MaxMoves];
+                        for (size_t i = 0; i < keptCount; ++i)
+                            best[i] = (uint8_t)i;
+
+                        stable_sort(best, best + keptCount, [&](uint8_t a, uint8_t b) { return kept[a]->compare(kept[b]) > 0; });
+                        sort(best, best + _maxMoves);
+
+                        for (size_t i = 0; i < _maxMoves; ++i)
+                            kept[i] = kept[best[i]];
+
+                        keptCount = _maxMoves;
+                    }
+
+                    if (!keptCount)
+                        continue;
+
+                    //Save
+                    allPositions++;
+                    uint16_t scale = count_scale(head);
+                    for (size_t i = 0; i < keptCount; ++i)
+                    {
+                        const ExpEntryEx* exp = kept[i];
+                        Current::ExpEntry e(exp->key, (Move)exp->move, (Value)exp->value, (Depth)exp->depth, max(exp->count / scale, 1));
+
+                        allMoves++;
+                        write_entry(&e, false);
+                    }
+                }
+
+                if (!write_entry(nullptr, true))
+                {
+                    sync_cout << "info string Failed to save experience entry to experience file [" << _target << "]" << sync_endl;
+                    return false;
+                }
+
+                return true;
+            }
+
+        public:
+            //'maxEntries' is an upper bound of the number of entries to be merged, if known
+            ExpRunMerger(const string& target, size_t maxEntries = numeric_limits<size_t>::max())
+                : _target(target), _version(Current::ExperienceVersion), _runSize(0), _run(nullptr),
+                  _minDepth(EXP_MIN_DEPTH), _minCount(0), _maxMoves(ExpPositionBuilder::MaxMoves), _positions(nullptr)
+            {
+                //Use an eighth of the memory for a run
+                uint64_t runBytes = SysInfo::total_memory_bytes() / 8;
+                runBytes = std::clamp(runBytes, (uint64_t)64 * 1024 * 1024, (uint64_t)4 * 1024 * 1024 * 1024);
+
+                _runCapacity = std::min((size_t)(runBytes / sizeof(ExpEntryEx)), std::max(maxEntries, (size_t)1));
+                _run = (ExpEntryEx*)aligned_large_pages_alloc(_runCapacity * sizeof(ExpEntryEx));
+                if (!_run)
+                    sync_cout << "info string Failed to allocate " << format_bytes(_runCapacity * sizeof(ExpEntryEx), 2) << " for experience merging" << sync_endl;
+            }
+
+            ~ExpRunMerger()
+            {
+                aligned_large_pages_free(_run);
+                remove_runs();
+            }
+
+            //Format of the target file: the current version or the compressed one
+            void set_version(int version)
+            {
+                _version = version;
+            }
+
+            //Only keep the moves with at least 'minDepth' and 'minCount', and the best 'maxMoves' of them in each position
+            void set_pruning(Depth minDepth, int minCount, size_t maxMoves)
+            {
+                _minDepth = minDepth;
+                _minCount = minCount;
+                _maxMoves = std::clamp<size_t>(maxMoves, 1, ExpPositionBuilder::MaxMoves);
+            }
+
+            //Only keep the positions of 'positions', sorted by key. The list must outlive the merge
+            void set_positions(const vector<Key>* positions)
+            {
+                _positions = positions;
+            }
+
+            //Read all the entries of an experience file into runs
+            bool add_file(const string& fn)
+            {
+                if (!_run)
+                    return false;
+
+                ifstream in(Utility::map_path(fn), ios::in | ios::binary | ios::ate);
+                if (!in.is_open())
+                {
+                    sync_cout << "info string Could not open experience file: " << fn << sync_endl;
+                    return false;
+                }
+
+                size_t inSize = in.tellg();
+                ExpReaders expReaders;
+                ExperienceReader* reader = inSize ? expReaders.find(in, inSize) : nullptr;
+                if (!reader)
+                {
+                    sync_cout << "info string The file [" << fn << "] is not a valid experience file" << sync_endl;
+                    return false;
+                }
+
+                size_t expCount = 0;
+
+                //Indexed data of a V3 file
+                if (reader->get_version() == V3::ExperienceVersion)
+                {
+                    ExpMapping mapping;
+                    if (!mapping.map(fn))
+                        return false;
+
+                    bool success = true;
+                    mapping.for_each([&](const ExpEntryEx* head)
+                        {
+                            for (const ExpEntryEx* temp = head; temp && success; temp = temp->next())
+                            {
+                                ExpEntryEx* exp = next_entry();
+                                if (!exp)
+                                {
+                                    success = false;
+                                    return;
+                                }
+
+                                new (exp) ExpEntryEx(temp->key, (Move)temp->move, (Value)temp->value, (Depth)temp->depth, temp->count);
+                                expCount++;
+                            }
+                        });
+
+                    if (!success)
+                        return false;
+                }
+
+                for (size_t i = 0, count; i < reader->entries_count(); i += count)
+                {
+                    count = std::min(reader->entries_count() - i, LoadChunkSize);
+
+                    ExpEntryEx* exp = next_entries(count);
+                    if (!exp)
+                        return false;
+
+                    if (!reader->read_range(in, i, count, exp))
+                    {
+                        sync_cout << "info string Failed to read experience entries #" << i + 1 << " to #" << i + count << " of " << reader->entries_count() << sync_endl;
+                        return false;
+                    }
+
+                    expCount += count;
+                }
+
+                sync_cout << "info string " << fn << " -> Total moves: " << expCount << sync_endl;
+
+                return true;
+            }
+
+            //Merge the runs into the target file (a backup of the existing file is made first)
+            bool merge()
+            {
+                if (!_run || !flush_run())
+                    return false;
+
+                //The runs are on disk: release the memory used to build them
+                aligned_large_pages_free(_run);
+                _run = nullptr;
+
+                //Create backup
+                string backupFilename;
+                if (Utility::file_exists(_target))
+                {
+                    backupFilename = _target + ".bak";
+                    remove(backupFilename.c_str());
+
+                    if (rename(_target.c_str(), backupFilename.c_str()) != 0)
+                    {
+                        sync_cout << "info string Could not create backup of current experience file" << sync_endl;
+                        return false;
+                    }
+                }
+
+                size_t allPositions = 0, allMoves = 0, duplicateMoves = 0;
+                bool success = write_target(allPositions, allMoves, duplicateMoves);
+                remove_runs();
+
+                if (!success)
+                {
+                    remove(_target.c_str());
+                    if (!backupFilename.empty() && rename(backupFilename.c_str(), _target.c_str()) != 0)
+                        sync_cout << "info string Could not restore backup experience file: " << backupFilename << sync_endl;
+
+                    return false;
+                }
+
+                sync_cout << "info string Saved " << allPositions << " position(s) and " << allMoves << " moves to experience file: " << _target
+                          << ". Duplicate moves: " << duplicateMoves << sync_endl;
+
+                return true;
+            }
+        };
+
+        //Merge a sealed journal into the experience file. Runs in the background, only working on files:
+        //the new experience file is built next to the current one and then replaces it
+        bool compact_journal(const string& expFilename, const string& journalFilename)
+        {
+            string compactFilename = expFilename + ".compact";
+            remove(compactFilename.c_str());
+
+            int version = Current::ExperienceVersion;
+            size_t expEntries = 0;
+            bool exists = Utility::file_exists(expFilename);
+            if (exists)
+                experience_file_info(expFilename, version, expEntries);
+
+            bool success;
+            if (version == V3::ExperienceVersion)
+            {
+                //Mapped, so only the journal is copied to memory
+                ExperienceData exp;
+                success =    exp.load(expFilename, true)
+                          && exp.load(journalFilename, true);
+
+                if (success)
+                {
+                    exp.set_save_version(V3::ExperienceVersion);
+                    exp.save(compactFilename, true, false);
+                    success = Utility::file_exists(compactFilename);
+                }
+            }
+            else
+            {
+                size_t entries = Utility::get_file_size(journalFilename) / sizeof(Current::ExpEntry) + expEntries;
+
+                //A compressed experience file stays compressed
+                ExpRunMerger merger(compactFilename, entries);
+                if (version == V4::ExperienceVersion)
+                    merger.set_version(version);
+
+                success =    (!exists || merger.add_file(expFilename))
+                          && merger.add_file(journalFilename)
+                          && merger.merge();
+            }
+
+            if (!success)
+            {
+                remove(compactFilename.c_str());
+                sync_cout << "info string Failed to compact experience journal [" << journalFilename << "]" << sync_endl;
+                return false;
+            }
+
+            //Replace the experience file, keeping the previous one as backup
+            string backupFilename = expFilename + ".bak";
+            remove(backupFilename.c_str());
+
+            if (   (Utility::file_exists(expFilename) && rename(expFilename.c_str(), backupFilename.c_str()) != 0)
+                || rename(compactFilename.c_str(), expFilename.c_str()) != 0)
+            {
+                sync_cout << "info string Could not replace experience file [" << expFilename << "] with compacted experience" << sync_endl;
+                return false;
+            }
+
+            remove(journalFilename.c_str());
+
+            sync_cout << "info string Compacted experience journal into experience file: " << expFilename << sync_endl;
+            return true;
+        }
+
+        //Memory used by an entry once loaded: the entry itself, and its share of the maps and index
+        constexpr uint64_t LoadedEntrySize = 2 * sizeof(ExpEntryEx);
+
+        //True if the experience files may not fit in memory when loaded together
+        bool needs_external_merge(const vector<string>& filenames)
+        {
+            uint64_t required = 0;
+            for (const string& fn : filenames)
+            {
+                int version;
+                size_t entries;
+                if (experience_file_info(fn, version, entries))
+                    required += std::max<uint64_t>(entries, Utility::get_file_size(fn) / sizeof(Current::ExpEntry)) * LoadedEntrySize;
+            }
+
+            //Leave half of the memory to the rest of the system
+            uint64_t available = SysInfo::total_memory_bytes() / 2;
+            return available && required > available;
+        }
+
+        //Experience probed by the search. A reload replaces it while the search goes on: the search threads
+        //read the pointer at every probe, and the replaced experience is deleted once they no longer use it
+        atomic<ExperienceData*> currentExperience(nullptr);
+        bool experienceEnabled = true;
+        bool learningPaused = false;
+        bool numaReplicas = false;
+
+        //Serializes the changes of the current experience (learning, saving, replacing it) and its use outside the search
+        mutex experienceMutex;
+
+        ////////////////////////////////////////////////////////////////
+        // Search threads as experience readers
+        ////////////////////////////////////////////////////////////////
+        //RCU-style grace periods: a search thread only keeps pointers into the experience until its next
+        //quiescent point (the start of an iteration, or the end of its search). Replaced experience is
+        //deleted once every thread went through one, or is not searching
+        atomic<uint64_t> readerEpoch(1);
+
+        struct ReaderSlot
+        {
+            atomic<uint64_t> epoch{0}; //Epoch at the last quiescent point, zero when not searching
+        };
+
+        mutex               readerSlotsMutex;
+        vector<ReaderSlot*> readerSlots;
+
+        //Slot of the current thread, registered on first use and removed when the thread exits
+        struct ReaderSlotHolder
+        {
+            ReaderSlot slot;
+
+            ReaderSlotHolder()
+            {
+                lock_guard<mutex> lock(readerSlotsMutex);
+                readerSlots.push_back(&slot);
+            }
+
+            ~ReaderSlotHolder()
+            {
+                lock_guard<mutex> lock(readerSlotsMutex);
+                readerSlots.erase(std::find(readerSlots.begin(), readerSlots.end(), &slot));
+            }
+        };
+
+        ReaderSlot& reader_slot()
+        {
+            thread_local ReaderSlotHolder holder;
+            return holder.slot;
+        }
+
+        void reader_quiescent()
+        {
+            reader_slot().epoch.store(readerEpoch.load(memory_order_seq_cst), memory_order_seq_cst);
+        }
+
+        void reader_offline()
+        {
+            reader_slot().epoch.store(0, memory_order_release);
+        }
+
+        //Wait until no search thread can use experience which was replaced before the call
+        void wait_for_readers()
+        {
+            uint64_t target = readerEpoch.fetch_add(1, memory_order_seq_cst) + 1;
+            while (true)
+            {
+                {
+                    lock_guard<mutex> lock(readerSlotsMutex);
+                    if (std::all_of(readerSlots.begin(), readerSlots.end(), [&](const ReaderSlot* slot)
+                        {
+                            uint64_t epoch = slot->epoch.load(memory_order_seq_cst);
+                            return !epoch || epoch >= target;
+                        }))
+                        return;
+                }
+
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+        }
+
+        ////////////////////////////////////////////////////////////////
+        // ExpReloader
+        ////////////////////////////////////////////////////////////////
+        //Loads an experience file in the background and then replaces the current experience with it. The
+        //experience learned meanwhile is carried over, the replaced experience is deleted after a grace period
+        class ExpReloader
+        {
+        private:
+            thread          _thread;
+            mutex           _mutex;
+            ExperienceData* _pending = nullptr;
+            atomic<bool>    _cancelled{false};
+            atomic<bool>    _running{false};
+
+            void reload(const string& filename)
+            {
+                bool loaded = _pending->load(filename, true, true);
+
+                ExperienceData* retired;
+                bool replaced = false;
+                {
+                    lock_guard<mutex> lock1(experienceMutex);
+                    lock_guard<mutex> lock2(_mutex);
+
+                    //A failed load keeps the current experience only if it comes from the same file. Another
+                    //file is used even so, starting empty, as it would be when loaded synchronously
+                    ExperienceData* current = currentExperience.load(memory_order_relaxed);
+                    bool keepCurrent = !loaded && current && Utility::is_same_file(current->filename(), filename);
+
+                    if (!keepCurrent && !_cancelled.load(memory_order_relaxed))
+                    {
+                        if (current)
+                            _pending->adopt_new_exp(*current);
+
+                        retired = currentExperience.exchange(_pending, memory_order_acq_rel);
+                        replaced = true;
+                        experience_changed();
+
+                        if (loaded)
+                            sync_cout << "info string Reloaded experience file: " << filename << sync_endl;
+                    }
+                    else
+                        retired = _pending;
+
+                    _pending = nullptr;
+                }
+
+                if (replaced)
+                    wait_for_readers();
+
+                delete retired;
+                _running.store(false, memory_order_release);
+            }
+
+        public:
+            ~ExpReloader()
+            {
+                cancel();
+            }
+
+            bool running() const
+            {
+                return _running.load(memory_order_acquire);
+            }
+
+            void start(const string& filename)
+            {
+                cancel();
+
+                _running.store(true, memory_order_relaxed);
+                _pending = new ExperienceData();
+                _thread = thread(&ExpReloader::reload, this, filename);
+            }
+
+            //Abort the reload in progress, if any
+            void cancel()
+            {
+                _cancelled.store(true, memory_order_relaxed);
+                {
+                    lock_guard<mutex> lock(_mutex);
+                    if (_pending)
+                        _pending->abort_loading();
+                }
+
+                if (_thread.joinable())
+                    _thread.join();
+
+                _cancelled.store(false, memory_order_relaxed);
+            }
+        };
+
+        ExpReloader reloader;
+    }
+
+    ////////////////////////////////////////////////////////////////
+    // Global experience functions
+    ////////////////////////////////////////////////////////////////
+    void init()
+    {
+        experienceEnabled = Options["Experience Enabled"];
+        if (!experienceEnabled)
+        {
+            unload();
+            return;
+        }
+
+        string filename = Options["Experience File"];
+
+        //Let a reload in progress finish, or stop it if another file is requested
+        reloader.cancel();
+
+        ExperienceData* current = currentExperience.load(memory_order_relaxed);
+        if (current && current->loading_result())
+        {
+            if (current->filename() == filename && !current->file_changed())
+                return;
+
+            //Keep using the current experience until the new one is loaded
+            save();
+            reloader.start(filename);
+            return;
+        }
+
+        if (current)
+            unload();
+
+        ExperienceData* exp = new ExperienceData();
+        exp->load(filename, false, true);
+        currentExperience.store(exp, memory_order_release);
+    }
+
+    //Reload the experience file in the background, while the search goes on with the current experience
+    void reload()
+    {
+        if (!experienceEnabled)
+            return;
+
+        if (reloader.running())
+        {
+            sync_cout << "info string The experience file is already being reloaded" << sync_endl;
+            return;
+        }
+
+        reloader.start(Options["Experience File"]);
+    }
+
+    bool enabled()
+    {
+        return experienceEnabled;
+    }
+
+    void unload()
+    {
+        reloader.cancel();
+        save();
+
+        lock_guard<mutex> lock(experienceMutex);
+        delete currentExperience.exchange(nullptr, memory_order_acq_rel);
+    }
+
+    void save()
+    {
+        lock_guard<mutex> lock(experienceMutex);
+
+        ExperienceData* exp = currentExperience.load(memory_order_relaxed);
+        if (!exp || !exp->has_new_exp() || (bool)Options["Experience Readonly"])
+            return;
+
+        if ((bool)Options["Experience Journal"])
+            exp->save_journal(exp->filename());
+        else
+            exp->save(exp->filename(), false, false);
+    }
+
+    const ExpEntryEx* probe(Key k)
+    {
+        assert(experienceEnabled);
+
+        ExperienceData* exp = currentExperience.load(memory_order_acquire);
+        return exp ? exp->probe(k) : nullptr;
+    }
+
+    const ExpEntryEx* probe(Key k, Depth minDepth)
+    {
+        assert(experienceEnabled);
+
+        ExperienceData* exp = currentExperience.load(memory_order_acquire);
+        return exp ? exp->probe(k, minDepth) : nullptr;
+    }
+
+    bool probe_best(Key k, ExpBest& best)
+    {
+        assert(experienceEnabled);
+
+        ExperienceData* exp = currentExperience.load(memory_order_acquire);
+        return exp && exp->probe_best(k, best);
+    }
+
+    void prefetch(Key k)
+    {
+        ExperienceData* exp = currentExperience.load(memory_order_acquire);
+        if (exp)
+            exp->prefetch(k);
+    }
+
+    void set_numa_replicas(bool enabled)
+    {
+        lock_guard<mutex> lock(experienceMutex);
+
+        numaReplicas = enabled;
+
+        ExperienceData* exp = currentExperience.load(memory_order_relaxed);
+        if (exp && !enabled)
+            exp->drop_replicas();
+    }
+
+    void attach_search_thread()
+    {
+        reader_quiescent();
+
+        ExperienceData* exp = currentExperience.load(memory_order_acquire);
+        if (exp)
+            exp->attach_search_thread(numaReplicas);
+    }
+
+    void quiescent_point()
+    {
+        reader_quiescent();
+    }
+
+    void detach_search_thread()
+    {
+        reader_offline();
+    }
+
+    void wait_for_loading_finished()
+    {
+        ExperienceData* exp = currentExperience.load(memory_order_acquire);
+        if (!exp)
+            return;
+
+        exp->wait_for_load_finished();
+    }
+
+    //Defrag command:
+    //Format:  defrag [filename] [version]
+    //Example: defrag C:\Path to\Experience\file.exp 3
+    //Note:    'filename' is optional. If omitted, then the default experience filename (Hypnos.exp) will be used
+    //         'filename' can contain spaces and can be a full path. If filename contains spaces, it is best to enclose it in quotations
+    //         'version' is optional. It is the format of the defragmented file: 2 (plain), 3 (indexed, memory mapped when loaded)
+    //         or 4 (compressed, about half the size of a plain file)
+    //         If omitted, the format of the file is kept
+    void defrag(int argc, char* argv[])
+    {
+        //Make sure experience has finished loading
+        //Not exactly needed here, but the messages shown when exp loading finish will
+        //disturb the progress messages shown by this function
+        wait_for_loading_finished();
+
+        int version = argc == 2 ? atoi(argv[1]) : 0;
+        if (argc < 1 || argc > 2 || (argc == 2 && version != Current::ExperienceVersion && version != V3::ExperienceVersion && version != V4::ExperienceVersion))
+        {
+            sync_cout << "info string Error : Incorrect defrag command" << sync_endl;
+            sync_cout << "info string Syntax: defrag [filename] [version]" << sync_endl;
+            return;
+        }
+
+        string filename = Utility::map_path(Utility::unquote(argv[0]));
+
+        //Print message
+        sync_cout << "\nDefragmenting experience file: " << filename << sync_endl;
+
+        //Map filename
+        filename = Utility::map_path(filename);
+
+        //Too large for memory: sort and merge on disk
+        if (needs_external_merge({ filename }))
+        {
+            size_t entries;
+            if (!version && !experience_file_info(filename, version, entries))
+                version = Current::ExperienceVersion;
+
+            if (version == V3::ExperienceVersion)
+                sync_cout << "info string The indexed format needs the whole experience in memory. Writing version " << Current::ExperienceVersion << sync_endl;
+
+            ExpRunMerger merger(filename);
+            if (version == V4::ExperienceVersion)
+                merger.set_version(version);
+
+            if (merger.add_file(filename))
+                merger.merge();
+
+            return;
+        }
+
+        //Load
+        ExperienceData exp;
+        if (!exp.load(filename, true))
+            return;
+
+        //Save
+        if (version)
+            exp.set_save_version(version);
+
+        exp.save(filename, true, false);
+    }
+
+    //Merge command:
+    //Format:  merge filename filename1 filename2 ... filenameX
+    //Example: defrag "C:\Path to\Experience\file.exp"
+    //Note:    'filename' is the target filename, which will also merged with the rest of the files if it exists
+    //         'filename1' ... 'filenameX' are the names of the experience files to be merged (along with filename)
+    //         'filename' can contain spaces but in that case it needs to eb quoted. It can also be a full path
+    void merge(int argc, char* argv[])
+    {
+        //Make sure experience has finished loading
+        //Not exactly needed here, but the messages shown when exp loading finish will
+        //disturb the progress messages shown by this function
+        wait_for_loading_finished();
+
+        //Step 1: Check
+        if (argc < 2)
+        {
+            sync_cout << "info string Error : Incorrect merge command" << sync_endl;
+            sync_cout << "info string Syntax: merge <filename> <filename1> [filename2] ... [filenameX]" << sync_endl;
+            sync_cout << "info string The first <filename> is also the target experience file which will contain all the merged data" << sync_endl;
+            sync_cout << "info string The files <filename1> ... <filenameX> are the other experience files to be merged" << sync_endl;
+            return;
+        }
+
+        //Step 2: Collect filenames
+        vector<string> filenames;
+        for (int i = 0; i < argc; ++i)
+            filenames.push_back(Utility::map_path(Utility::unquote(argv[i])));
+
+        //Step 3: The first filename is also the target filename
+        string targetFilename = filenames.front();
+
+        //Print message
+        sync_cout << "\nMerging experience files: ";
+        for (const string& fn : filenames)
+            cout << "\n\t" << fn;
+
+        cout << "\nTarget file: " << targetFilename << "\n" << sync_endl;
+
+        //Step 4: Load and merge, on disk if the files are too large for memory
+        if (needs_external_merge(filenames))
+        {
+            //A compressed target file stays compressed
+            int version;
+            size_t entries;
+            ExpRunMerger merger(targetFilename);
+            if (experience_file_info(targetFilename, version, entries) && version == V4::ExperienceVersion)
+                merger.set_version(version);
+
+            for (const string& fn : filenames)
+                merger.add_file(fn);
+
+            merger.merge();
+            return;
+        }
+
+        ExperienceData exp;
+        for (const string& fn : filenames)
+            exp.load(fn, true);
+
+        exp.save(targetFilename, true, false);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    //Experience statistics
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    namespace
+    {
+        //Counts of values by bin. Each bin starts at its bound, the first one also takes the smaller values
+        class Histogram
+        {
+        private:
+            vector<int64_t>  _bounds;
+            vector<uint64_t> _counts;
+
+        public:
+            Histogram(initializer_list<int64_t> bounds) : _bounds(bounds), _counts(bounds.size(), 0) {}
+
+            void add(int64_t v, uint64_t n = 1)
+            {
+                size_t bin = std::upper_bound(_bounds.begin() + 1, _bounds.end(), v) - _bounds.begin() - 1;
+                _counts[bin] += n;
+            }
+
+            void merge(const Histogram& other)
+            {
+                for (size_t i = 0; i < _counts.size(); ++i)
+                    _counts[i] += other._counts[i];
+            }
+
+            void print(const string& title) const
+            {
+                uint64_t total = 0;
+                for (uint64_t c : _counts)
+                    total += c;
+
+                cout << title << ":" << endl;
+                for (size_t i = 0; i < _counts.size(); ++i)
+                {
+                    string range = i + 1 == _counts.size()     ? ">= " + to_string(_bounds[i])
+                                 : _bounds[i + 1] - 1 == _bounds[i] ? to_string(_bounds[i])
+                                 : to_string(_bounds[i]) + " .. " + to_string(_bounds[i + 1] - 1);
+
+                    cout << "  " << setw(16) << range << ": " << setw(12) << _counts[i]
+                         << setw(9) << fixed << setprecision(2) << (total ? 100.0 * _counts[i] / total : 0.0) << "%" << endl;
+                }
+            }
+        };
+
+        //Statistics of the entries scanned by a thread
+        struct EntryStats
+        {
+            uint64_t  entries = 0;
+            Histogram depth{ 0, 4, 10, 15, 20, 25, 30, 35, 40, 45, 50, 60 };
+            Histogram count{ 0, 1, 2, 3, 5, 9, 17, 33, 65, 129, 257, 1025 };
+            Histogram value{ -VALUE_INFINITE, -VALUE_TB_WIN_IN_MAX_PLY, -2000, -1000, -500, -200, -100, -50, -20, 0, 21, 51, 101, 201, 501, 1001, 2001, VALUE_TB_WIN_IN_MAX_PLY };
+
+            //Keys of the entries, by shard
+            vector<Key> keys[ExpShards::ShardCount];
+
+            void add(const Current::ExpEntry& e)
+            {
+                entries++;
+                depth.add(e.depth);
+                count.add(e.count);
+                value.add(e.value);
+                keys[ExpShards::shard_of(e.key)].push_back(e.key);
+            }
+
+            void merge(const EntryStats& other)
+            {
+                entries += other.entries;
+                depth.merge(other.depth);
+                count.merge(other.count);
+                value.merge(other.value);
+            }
+        };
+
+        //Entries to scan: mapped entries, or entries decoded by the reader of the file
+        struct ScanWork
+        {
+            const Current::ExpEntry* data;
+            size_t                   first;
+            size_t                   count;
+        };
+    }
+
+    //Statistics command:
+    //Format:  exp_stats [filename]
+    //Example: exp_stats "C:\Path to\Experience\file.exp"
+    //Note:    'filename' is optional. If omitted, then the default experience filename (Hypnos.exp) will be used
+    //         The file is scanned once, by several threads, memory mapped when its format allows it. Shows the
+    //         depth, count and value histograms, the number of moves per position and the expected layout and
+    //         probe cost of the index built when the file is loaded
+    //         Needs 8 bytes of memory per entry of the file
+    void stats(int argc, char* argv[])
+    {
+        //Make sure experience has finished loading
+        wait_for_loading_finished();
+
+        if (argc != 1)
+        {
+            sync_cout << "info string Error : Incorrect exp_stats command" << sync_endl;
+            sync_cout << "info string Syntax: exp_stats [filename]" << sync_endl;
+            return;
+        }
+
+        string filename = Utility::map_path(Utility::unquote(argv[0]));
+
+        sync_cout << "\nScanning experience file: " << filename << sync_endl;
+
+        //Step 1: Recognize the format
+        ifstream in(filename, ios::in | ios::binary | ios::ate);
+        if (!in.is_open())
+        {
+            sync_cout << "info string Could not open experience file: " << filename << sync_endl;
+            return;
+        }
+
+        size_t inSize = in.tellg();
+        ExpReaders expReaders;
+        ExperienceReader* reader = inSize ? expReaders.find(in, inSize) : nullptr;
+        if (!reader)
+        {
+            sync_cout << "info string The file [" << filename << "] is not a valid experience file" << sync_endl;
+            return;
+        }
+
+        in.close();
+
+        //Step 2: Split the entries in chunks. Plain and indexed files are scanned in place, other formats are decoded
+        ExpMapping mapping;
+        Utility::FileMapping file;
+        vector<ScanWork> work;
+
+        auto add_work = [&](const Current::ExpEntry* data, size_t count)
+        {
+            for (size_t first = 0; first < count; first += LoadChunkSize)
+                work.push_back({ data ? data + first : nullptr, first, std::min(LoadChunkSize, count - first) });
+        };
+
+        const int version = reader->get_version();
+        if (version == V3::ExperienceVersion)
+        {
+            if (!mapping.map(filename))
+                return;
+
+            add_work(mapping.record_data(), mapping.records());
+            add_work(reinterpret_cast<const Current::ExpEntry*>(mapping.data() + reader->entries_offset()), reader->entries_count());
+        }
+        else if (version == Current::ExperienceVersion)
+        {
+            if (!file.map(filename, true))
+                return;
+
+            file.advise_sequential();
+            add_work(reinterpret_cast<const Current::ExpEntry*>(file.data() + reader->entries_offset()), reader->entries_count());
+        }
+        else
+            add_work(nullptr, reader->entries_count());
 
-                        writeBuffer.clear();
-                    }
+        size_t totalEntries = 0;
+        for (const ScanWork& w : work)
+            totalEntries += w.count;
 
-                    return success;
-                };
+        //Step 3: Scan the chunks
+        const size_t threadCount = std::max<size_t>(std::min<size_t>(std::max(thread::hardware_concurrency(), 1U), work.size()), 1);
+        vector<EntryStats> threadStats(threadCount);
+        atomic<size_t> nextWork(0);
+        atomic<size_t> progress(0);
+        atomic<bool>   failed(false);
 
-                size_t allMoves = 0;
-                size_t allPositions = 0;
-                if (saveAll)
-                {
-                    for (ExpEntryEx* expEx : _newPvExp)
-                        link_entry(expEx);
+        auto run_threads = [&](auto f)
+        {
+            nextWork.store(0, memory_order_relaxed);
+
+            vector<thread> threads;
+            for (size_t t = 1; t < threadCount; ++t)
+                threads.emplace_back([&, t]() { f(threadStats[t]); });
+
+            f(threadStats[0]);
 
-                    for (ExpEntryEx* expEx : _newMultiPvExp)
-                        link_entry(expEx);
+            for (thread& th : threads)
+                th.join();
+        };
+
+        run_threads([&](EntryStats& stats)
+            {
+                ifstream input;
+                vector<char> buffer;
 
-                    ExpEntryEx* exp = nullptr;
-                    for (auto& x : _mainExp)
+                size_t w;
+                while ((w = nextWork.fetch_add(1, memory_order_relaxed)) < work.size() && !failed.load(memory_order_relaxed))
+                {
+                    const ScanWork& chunk = work[w];
+                    const Current::ExpEntry* entries = chunk.data;
+                    if (!entries)
                     {
-                        allPositions++;
-                        exp = x.second;
+                        if (!input.is_open())
+                            input.open(filename, ios::in | ios::binary);
 
-                        //Scale counts
-                        uint16_t maxCount = numeric_limits<uint8_t>::min();
-                        ExpEntryEx* exp1 = exp;
-                        while (exp1)
+                        buffer.resize(chunk.count * sizeof(Current::ExpEntry));
+                        Current::ExpEntry* data = reinterpret_cast<Current::ExpEntry*>(buffer.data());
+                        if (!input.is_open() || !reader->read_range(input, chunk.first, chunk.count, data))
                         {
-                            maxCount = max(maxCount, exp1->count);
-                            exp1 = exp1->next;
+                            sync_cout << "info string Failed to read experience entries #" << chunk.first + 1 << " to #" << chunk.first + chunk.count << sync_endl;
+                            failed.store(true, memory_order_relaxed);
+                            return;
                         }
 
-                        //Scale down
-                        uint16_t scale = 1 + maxCount / 128;
-                        exp1 = exp;
-                        while (exp1)
-                        {
-                            exp1->count = max(exp1->count / scale, 1);
-                            exp1 = exp1->next;
-                        }
+                        entries = data;
+                    }
 
-                        //Save
-                        while (exp)
-                        {
-                            if (exp->depth >= EXP_MIN_DEPTH)
-                            {
-                                allMoves++;
-                                if (!write_entry(exp, false))
-                                {
-                                    sync_cout << "info string Failed to save experience entry to experience file [" << fn << "]" << sync_endl;
-                                    return false;
-                                }
-                            }
+                    for (size_t i = 0; i < chunk.count; ++i)
+                        stats.add(entries[i]);
 
-                            exp = exp->next;
-                        }
+                    if (totalEntries >= LoadProgressMinEntries)
+                    {
+                        size_t done = progress.fetch_add(chunk.count, memory_order_relaxed);
+                        if ((done + chunk.count) * 10 / totalEntries != done * 10 / totalEntries)
+                            sync_cout << "info string Scanning experience file: " << (done + chunk.count) * 100 / totalEntries << "%" << sync_endl;
                     }
-
-                    sync_cout << "info string Saved " << allPositions << " position(s) and " << allMoves << " moves to experience file: " << fn << sync_endl;
                 }
-                else
+            });
+
+        if (failed.load(memory_order_relaxed))
+            return;
+
+        //Step 4: Positions. Keys are grouped by shard, the shards cover increasing key ranges
+        Histogram movesPerPosition{ 1, 2, 3, 4, 5, 6, 11, 21, 51 };
+        vector<vector<Key>> shardKeys(ExpShards::ShardCount);
+        vector<Histogram> threadMoves(threadCount, movesPerPosition);
+
+        run_threads([&](EntryStats& stats)
+            {
+                Histogram& moves = threadMoves[&stats - &threadStats[0]];
+
+                size_t shard;
+                while ((shard = nextWork.fetch_add(1, memory_order_relaxed)) < ExpShards::ShardCount)
                 {
-                    for (auto &newExp : { _newPvExp, _newMultiPvExp })
+                    vector<Key>& keys = shardKeys[shard];
+                    for (EntryStats& s : threadStats)
                     {
-                        for (const ExpEntryEx* exp : newExp)
-                        {
-                            if (exp->depth < EXP_MIN_DEPTH)
-                                continue;
+                        keys.insert(keys.end(), s.keys[shard].begin(), s.keys[shard].end());
+                        vector<Key>().swap(s.keys[shard]);
+                    }
 
-                            if (!write_entry(exp, false))
-                            {
-                                sync_cout << "info string Failed to save experience entry to experience file [" << fn << "]" << sync_endl;
-                                return false;
-                            }
-                        }
+                    sort(keys.begin(), keys.end());
+
+                    //Keep one key per position
+                    size_t positions = 0;
+                    for (size_t i = 0, j; i < keys.size(); i = j)
+                    {
+                        for (j = i + 1; j < keys.size() && keys[j] == keys[i]; ++j) {}
+
+                        moves.add(j - i);
+                        keys[positions++] = keys[i];
                     }
 
-                    sync_cout << "info string Saved " << _newPvExp.size() << " PV and " << _newMultiPvExp.size() << " MultiPV entries to experience file: " << fn << sync_endl;
+                    keys.resize(positions);
+                    keys.shrink_to_fit();
                 }
+            });
 
-                //Flush buffer
-                write_entry(nullptr, true);
+        EntryStats total;
+        for (size_t t = 0; t < threadCount; ++t)
+        {
+            total.merge(threadStats[t]);
+            movesPerPosition.merge(threadMoves[t]);
+        }
 
-                //Clear new moves
-                clear_new_exp();
+        size_t positions = 0;
+        for (const vector<Key>& keys : shardKeys)
+            positions += keys.size();
+
+        //Step 5: Index and prefilter as built when the file is loaded. Keys come in increasing order, and so do their
+        //home buckets: linear probing is simulated bucket by bucket (the layout does not depend on the insertion order,
+        //the few positions which would wrap around to the first buckets are kept past the last one instead)
+        const size_t bucketCount = ExpIndex::bucket_count_for(positions);
+        Histogram occupancy{ 0, 1, 2, 3, 4 };
+        uint64_t displacement = 0;
+        uint64_t displaced = 0;
+        uint64_t missCost = 0;
+        size_t   fullRun = 0;
+
+        size_t bucket = 0;
+        int    used = 0;
+
+        //Close the current bucket: a miss starting in a run of full buckets reads them all, and the next one
+        auto close_bucket = [&]()
+        {
+            occupancy.add(used);
 
-                return true;
+            if (used == ExpIndex::BucketSize)
+                fullRun++;
+            else
+            {
+                missCost += (fullRun + 1) * (fullRun + 2) / 2 + fullRun;
+                fullRun = 0;
             }
 
-        public:
-            ExperienceData()
+            used = 0;
+            bucket++;
+        };
+
+        ExpFilter filter;
+        filter.init(positions);
+
+        for (const vector<Key>& keys : shardKeys)
+            for (Key k : keys)
             {
-                _loading = false;
-                _abortLoading.store(false, memory_order_relaxed);
-                _loadingResult.store(false, memory_order_relaxed);
-                _loaderThread = nullptr;
+                filter.add(k);
+
+                size_t home = mul_hi64(k, bucketCount);
+                while (bucket < home)
+                    close_bucket();
+
+                if (used == ExpIndex::BucketSize)
+                    close_bucket();
+
+                used++;
+                displacement += bucket - home;
+                displaced += bucket != home;
             }
 
-            ~ExperienceData()
+        while (bucket < bucketCount)
+            close_bucket();
+
+        missCost += fullRun * (fullRun + 1) / 2;
+
+        //Step 6: Report
+        const double fpr = filter.false_positive_rate();
+        const double missLines = 1.0 + fpr * missCost / bucket;
+        const double hitLines = 1.0 + (positions ? 1.0 + (double)displacement / positions : 1.0) + 1.0;
+        const uint64_t indexSize = bucketCount * sizeof(ExpIndex::Bucket);
+        const uint64_t filterSize = filter.word_count() * sizeof(uint64_t);
+
+        sync_cout << "\nExperience file: " << filename << "\n"
+                  << "Format version : " << version << "\n"
+                  << "File size      : " << format_bytes(inSize, 2) << "\n"
+                  << "Entries        : " << total.entries << "\n"
+                  << "Positions      : " << positions << "\n"
+                  << "Fragmentation  : " << fixed << setprecision(2)
+                  << (total.entries ? 100.0 * (total.entries - positions) / total.entries : 0.0) << "% of the entries share a position with an earlier one\n" << endl;
+
+        total.depth.print("Depth");
+        cout << endl;
+        total.count.print("Count");
+        cout << endl;
+        total.value.print("Value (internal units)");
+        cout << endl;
+        movesPerPosition.print("Entries per position");
+
+        cout << "\nIndex          : " << bucketCount << " buckets of " << ExpIndex::BucketSize << " slots (" << format_bytes(indexSize, 2) << "), load factor "
+             << fixed << setprecision(2) << 100.0 * positions / (bucketCount * ExpIndex::BucketSize) << "%" << endl;
+        occupancy.print("Used slots per bucket");
+        cout << "Displaced positions: " << displaced << " (" << (positions ? 100.0 * displaced / positions : 0.0) << "%), "
+             << (positions ? (double)displacement / positions : 0.0) << " extra buckets per hit on average" << endl;
+
+        cout << "\nPrefilter      : " << filter.word_count() << " words (" << format_bytes(filterSize, 2) << "), false positive rate "
+             << setprecision(2) << fpr * 100.0 << "%" << endl;
+
+        cout << "Estimated cache lines per probe: " << setprecision(3) << missLines << " for a position without experience, "
+             << hitLines << " for a position with experience (prefilter, index, list head)" << endl;
+
+        cout << "Estimated memory when loaded   : " << format_bytes(total.entries * LoadedEntrySize, 2)
+             << " (mapped from an indexed file: " << format_bytes(total.entries * sizeof(ExpEntryEx) + indexSize + filterSize, 2) << ")" << sync_endl;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    //Conversion of games to experience entries
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    namespace
+    {
+        //Input converted by a thread at a time (extended to the end of the line)
+        constexpr size_t ConversionChunkSize = 4 * 1024 * 1024;
+
+        //Number of chunks, per thread, that the conversion threads can be ahead of the writer
+        constexpr size_t ConversionChunksPerThread = 4;
+
+        //Start position of the PGN games without a FEN tag
+        constexpr const char* StartFEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+        //Game and move statistics of a conversion
+        struct ConversionStats
+        {
+            //Game statistics
+            size_t numGames = 0;
+            size_t numGamesWithErrors = 0;
+            size_t numGamesIgnored = 0;
+
+            //Move statistics
+            size_t numMovesWithScores = 0;
+            size_t numMovesWithScoresIgnored = 0;
+            size_t numMovesWithoutScores = 0;
+
+            //WBD statistics
+            size_t wbd[COLOR_NB + 1] = { 0, 0, 0 };
+
+            void add(const ConversionStats& s)
             {
-                clear();
+                numGames += s.numGames;
+                numGamesWithErrors += s.numGamesWithErrors;
+                numGamesIgnored += s.numGamesIgnored;
+
+                numMovesWithScores += s.numMovesWithScores;
+                numMovesWithScoresIgnored += s.numMovesWithScoresIgnored;
+                numMovesWithoutScores += s.numMovesWithoutScores;
+
+                for (int c = WHITE; c <= COLOR_NB; ++c)
+                    wbd[c] += s.wbd[c];
             }
+        };
 
-        public:
+        //Conversion settings, the same for all the game formats
+        struct ConversionSettings
+        {
+            string inputPath;
+            string outputPath;
+            int maxPly;
+            Value maxValue;
+            Depth minDepth;
+            Depth maxDepth;
+        };
 
-            string filename() const
+        //Read the arguments of a conversion command: <input> <output> [maxPly] [maxValue] [minDepth] [maxDepth]
+        bool read_conversion_settings(int argc, char* argv[], const string& inputName, ConversionSettings& settings)
+        {
+            if (argc < 2)
             {
-                return _filename;
+                sync_cout << "Expecting at least 2 arguments, received: " << argc << sync_endl;
+                return false;
             }
 
-            bool has_new_exp() const
+            settings.inputPath  = Utility::unquote(argv[0]);
+            settings.outputPath = Utility::unquote(argv[1]);
+            settings.maxPly     = argc >= 3 ? atoi(argv[2])        : 1000;
+            settings.maxValue   = argc >= 4 ? (Value)atoi(argv[3]) : (Value)VALUE_MATE;
+            settings.minDepth   = argc >= 5 ? max((Depth)atoi(argv[4]), EXP_MIN_DEPTH) : EXP_MIN_DEPTH;
+            settings.maxDepth   = argc >= 6 ? max((Depth)atoi(argv[5]), EXP_MIN_DEPTH) : (Depth)MAX_PLY;
+
+            string inputLabel = inputName;
+            inputLabel.resize(16, ' ');
+
+            sync_cout                                                           << endl
+                      << "Building experience from PGN: "                       << endl
+                      << "\t" << inputLabel << ": " << settings.inputPath       << endl
+                      << "\tExperience file : "      << settings.outputPath     << endl
+                      << "\tMax ply         : "      << settings.maxPly         << endl
+                      << "\tMax value       : "      << settings.maxValue       << endl
+                      << "\tDepth range     : "      << settings.minDepth       << " - " << settings.maxDepth
+                                                                                << endl << sync_endl;
+
+            return true;
+        }
+
+        //Split a string the same way getline() would: empty fields are kept, except a trailing one
+        void split(string_view str, char delimiter, vector<string_view>& fields)
+        {
+            fields.clear();
+            while (!str.empty())
             {
-                return _newPvExp.size() || _newMultiPvExp.size();
+                size_t end = str.find(delimiter);
+                fields.push_back(str.substr(0, end));
+
+                if (end == string_view::npos)
+                    break;
+
+                str.remove_prefix(end + 1);
             }
+        }
 
-            bool load(string filename, bool synchronous)
-            {
-                //Make sure we are not already in the process of loading same/other experience file
-                wait_for_load_finished();
+        //Parse an integer the same way stoi() would, except that bad input is reported instead of thrown
+        bool parse_int(string_view str, int& value)
+        {
+            str.remove_prefix(std::min(str.find_first_not_of(" \t\r\n"), str.size()));
+            if (!str.empty() && str.front() == '+')
+                str.remove_prefix(1);
 
-                //Load requested experience file
-                _filename = filename;
-                _loadingResult.store(false, memory_order_relaxed);
+            return from_chars(str.data(), str.data() + str.size(), value).ec == errc();
+        }
 
-                //Block
-                {
-                    _loading = true;
-                    lock_guard<mutex> lg1(_loaderMutex);
-                    _loaderThread = new thread(thread([this, filename]()
-                        {
-                            //Load
-                            bool loadingResult = _load(filename);
-                            _loadingResult.store(loadingResult, memory_order_relaxed);
+        //Replays a game and collects the experience entries of its moves. The entries are only kept
+        //if the game result is consistent with the engine evaluations (we can't trust PGN scores blindly)
+        class GameConverter
+        {
+        private:
+            static constexpr Value GOOD_SCORE = PawnValue * 3;
+            static constexpr Value OK_SCORE = GOOD_SCORE / 2;
+            static constexpr Value MAX_DRAW_SCORE = (Value)50;
+            static constexpr int MIN_WEIGHT_FOR_DRAW = 8;
+            static constexpr int MIN_WEIGHT_FOR_WIN = 16;
+            static constexpr int MIN_PLY_PER_GAME = 16;
+            static constexpr Bitboard DarkSquares = 0xAA55AA55AA55AA55ULL;
+
+            const int maxPly;
+            const Value maxValue;
+            const Depth minDepth;
+            const Depth maxDepth;
 
-                            //Copy pointer of loader thread so that we can
-                            //clear the variable now and and deleted later
-                            thread *t = _loaderThread;
-                            _loaderThread = nullptr;
+            Position pos;
+            deque<StateInfo> states;
 
-                            //Notify
-                            {
-                                lock_guard<mutex> lg2(_loaderMutex);
-                                _loading = false;
-                                _loadingCond.notify_one();
-                            }
-                            
-                            //Detach and delete loader thread
-                            t->detach();
-                            delete t;
-                        }));
-                }
+            Color winnerColor;
+            Color detectedWinnerColor;
+            bool drawDetected;
+            int resultWeight[COLOR_NB + 1];
+            int gamePly;
 
-                return synchronous ? wait_for_load_finished() : true;
-            }
+            vector<char> entries;
 
-            bool wait_for_load_finished()
+        public:
+            GameConverter(const ConversionSettings& settings)
+                : maxPly(settings.maxPly), maxValue(settings.maxValue), minDepth(settings.minDepth), maxDepth(settings.maxDepth)
             {
-                unique_lock<mutex> ul(_loaderMutex);
-                _loadingCond.wait(ul, [&] { return !_loading; });
-                return loading_result();
             }
 
-            bool loading_result() const
+            const Position& position() const
             {
-                return _loadingResult.load(memory_order_relaxed);
+                return pos;
             }
 
-            void save(string fn, bool saveAll, bool ignoreLoadingCheck)
+            //Start a new game. 'winner' is the game result as read from PGN (COLOR_NB for a draw)
+            void start(const string& fen, bool chess960, Color winner)
             {
-                //Make sure we are not already in the process of loading same/other experience file
-                if(!ignoreLoadingCheck)
-                    wait_for_load_finished();
+                winnerColor = winner;
+                detectedWinnerColor = COLOR_NB;
+                drawDetected = false;
+                memset((void*)&resultWeight, 0, sizeof(resultWeight));
+                gamePly = 0;
+                entries.clear();
 
-                if (!has_new_exp() && (!saveAll || _mainExp.size() == 0))
-                    return;
+                states.clear();
+                states.emplace_back();
+                pos.set(fen, chess960, &states.back(), Threads.main());
+            }
 
-                //Step 1: Create backup only if 'saveAll' is 'true'
-                string expFilename = Utility::map_path(fn);
-                string backupExpFilename;
-                if (saveAll && Utility::file_exists(expFilename))
+            //Play the next move of the game, with its engine evaluation if any. Returns false if the game is to be ignored
+            bool play(Move move, Value score, Depth depth, ConversionStats& stats)
+            {
+                ++gamePly;
+
+                if (depth != DEPTH_NONE && score != VALUE_NONE)
                 {
-                    backupExpFilename = expFilename + ".bak";
+                    if (gamePly <= maxPly && depth >= minDepth && depth <= maxDepth && abs(score) <= maxValue)
+                    {
+                        ++stats.numMovesWithScores;
 
-                    //If backup file already exists then delete it
-                    if (Utility::file_exists(backupExpFilename))
+                        Current::ExpEntry tempExp(pos.key(), move, score, depth);
+                        const char* data = reinterpret_cast<const char*>(&tempExp);
+                        entries.insert(entries.end(), data, data + sizeof(tempExp));
+                    }
+                    else
                     {
-                        if (remove(backupExpFilename.c_str()) != 0)
-                        {
-                            sync_cout << "info string Could not deleted existing backup file: " << backupExpFilename << sync_endl;
+                        ++stats.numMovesWithScoresIgnored;
+                    }
 
-                            //Clear backup filename
-                            backupExpFilename.clear();
+                    //////////////////////////////////////////////////////////////////
+                    //Guess game result and apply sanity checks
+                    if (abs(score) >= VALUE_TB_WIN_IN_MAX_PLY)
+                    {
+                        Color winnerColorBasedOnThisMove = score > 0 ? pos.side_to_move() : ~pos.side_to_move();
+                        if (detectedWinnerColor == COLOR_NB)
+                        {
+                            detectedWinnerColor = winnerColorBasedOnThisMove;
+                            if (detectedWinnerColor != winnerColor)
+                            {
+                                ++stats.numGamesIgnored;
+                                return false;
+                            }
+                        }
+                        else if (detectedWinnerColor != winnerColorBasedOnThisMove)
+                        {
+                            ++stats.numGamesIgnored;
+                            return false;
                         }
                     }
+                    else if (pos.is_draw(pos.is_draw(pos.game_ply())))
+                    {
+                        drawDetected = true;
+                    }
 
-                    //Rename current experience file
-                    if (!backupExpFilename.empty())
+                    //Detect score pattern
+                    if (abs(score) >= GOOD_SCORE)
                     {
-                        if (rename(expFilename.c_str(), backupExpFilename.c_str()) != 0)
-                        {
-                            sync_cout << "info string Could not create backup of current experience file" << sync_endl;
+                        resultWeight[COLOR_NB] = 0;
+                        resultWeight[score > 0 ? pos.side_to_move() : ~pos.side_to_move()] += score < 0 ? 4 : 2;
+                        resultWeight[score > 0 ? ~pos.side_to_move() : pos.side_to_move()] = 0;
+                    }
+                    else if (abs(score) >= OK_SCORE)
+                    {
+                        resultWeight[COLOR_NB] /= 2;
+                        resultWeight[score > 0 ? pos.side_to_move() : ~pos.side_to_move()] += score < 0 ? 2 : 1;
+                        resultWeight[score > 0 ? ~pos.side_to_move() : pos.side_to_move()] /= 2;
+                    }
+                    else if (abs(score) <= MAX_DRAW_SCORE)
+                    {
+                        resultWeight[COLOR_NB] += 2;
+                        resultWeight[WHITE] = 0;
+                        resultWeight[BLACK] = 0;
+                    }
+                    else
+                    {
+                        resultWeight[COLOR_NB] += 1;
+                        resultWeight[WHITE] /= 2;
+                        resultWeight[BLACK] /= 2;
+                    }
+                }
+                else
+                {
+                    ++stats.numMovesWithoutScores;
+                }
 
-                            //Clear backup filename
-                            backupExpFilename.clear();
-                        }
+                //Do the move
+                states.emplace_back();
+                pos.do_move(move, states.back());
+
+                //////////////////////////////////////////////////////////////////
+                //Detect draw by insufficient material
+                if (!drawDetected)
+                {
+                    int num_pieces = pos.count<ALL_PIECES>();
+
+                    if (num_pieces == 2) //KvK
+                    {
+                        drawDetected = true;
+                    }
+                    else if (num_pieces == 3 && (pos.count<BISHOP>() + pos.count<KNIGHT>()) == 1) //KvK + 1 minor piece
+                    {
+                        drawDetected = true;
                     }
-                }
-
-                //Step 2: Save
-                if (!_save(fn, saveAll))
-                {
-                    //Step 2a: Restore backup in case of failure while saving
-                    if (!backupExpFilename.empty())
+                    else if (num_pieces == 4 && pos.count<BISHOP>(WHITE) == 1 && pos.count<BISHOP>(BLACK) == 1) //KBvKB, bishops of the same color
                     {
-                        if (rename(backupExpFilename.c_str(), expFilename.c_str()) != 0)
-                        {
-                            sync_cout << "info string Could not restore backup experience file: " << backupExpFilename << sync_endl;
-                        }
+                        if (
+                            ((pos.pieces(WHITE, BISHOP) & DarkSquares) && (pos.pieces(BLACK, BISHOP) & DarkSquares))
+                            || ((pos.pieces(WHITE, BISHOP) & ~DarkSquares) && (pos.pieces(BLACK, BISHOP) & ~DarkSquares)))
+                            drawDetected = true;
                     }
                 }
-            }
 
-            const ExpEntryEx* probe(Key k) const
-            {
-                ExpConstIterator itr = _mainExp.find(k);
-                if (itr == _mainExp.end())
-                    return nullptr;
-
-                assert(itr->second->key == k);
+                //If draw is detected but game result isn't draw then reject the game
+                if (drawDetected && detectedWinnerColor != COLOR_NB)
+                {
+                    ++stats.numGamesIgnored;
+                    return false;
+                }
 
-                return itr->second;
+                return true;
             }
 
-            void add_pv_experience(Key k, Move m, Value v, Depth d)
+            //End the game and append its experience entries to 'out'. Returns false if the game is to be ignored
+            bool finish(vector<char>& out, ConversionStats& stats)
             {
-                ExpEntryEx* exp = new ExpEntryEx(k, m, v, d, 1);
-
-                if (exp)
+                //Does the game have enough moves?
+                if (gamePly < MIN_PLY_PER_GAME)
                 {
-                    _newPvExp.emplace_back(exp);
-                    link_entry(exp);
+                    ++stats.numGamesIgnored;
+                    return false;
                 }
-            }
 
-            void add_multipv_experience(Key k, Move m, Value v, Depth d)
-            {
-                ExpEntryEx* exp = new ExpEntryEx(k, m, v, d, 1);
+                //If winner isn't yet identified, check result weights and try to identify it
+                if (detectedWinnerColor == COLOR_NB)
+                {
+                    if (resultWeight[WHITE] >= MIN_WEIGHT_FOR_WIN)
+                        detectedWinnerColor = WHITE;
+                    else if (resultWeight[BLACK] >= MIN_WEIGHT_FOR_WIN)
+                        detectedWinnerColor = BLACK;
+                }
 
-                if (exp)
+                //////////////////////////////////////////////////////////////////
+                //More sanity checks
+                if (   (detectedWinnerColor != winnerColor)
+                    || (winnerColor != COLOR_NB && resultWeight[winnerColor] < MIN_WEIGHT_FOR_WIN)
+                    || (winnerColor == COLOR_NB && !drawDetected && resultWeight[COLOR_NB] < MIN_WEIGHT_FOR_DRAW))
                 {
-                    _newMultiPvExp.emplace_back(exp);
-                    link_entry(exp);
+                    ++stats.numGamesIgnored;
+                    return false;
                 }
-            }
-        };
 
-        ExperienceData*currentExperience = nullptr;
-        bool experienceEnabled = true;
-        bool learningPaused = false;
-    }
+                //Update WBD stats
+                ++stats.wbd[winnerColor];
 
-    ////////////////////////////////////////////////////////////////
-    // Global experience functions
-    ////////////////////////////////////////////////////////////////
-    void init()
-    {
-        experienceEnabled = Options["Experience Enabled"];
-        if (!experienceEnabled)
-        {
-            unload();
-            return;
-        }
+                out.insert(out.end(), entries.begin(), entries.end());
+                return true;
+            }
+        };
 
-        string filename = Options["Experience File"];
-        if (currentExperience)
+        //Converts compact PGN games, one per line. Each conversion thread has its own converter
+        class CompactPgnConverter
         {
-            if (currentExperience->filename() == filename && currentExperience->loading_result())
-                return;
-
-            if (currentExperience)
-                unload();
-        }
-
-        currentExperience = new ExperienceData();
-        currentExperience->load(filename, false);
-    }
-
-    bool enabled()
-    {
-        return experienceEnabled;
-    }
-
-    void unload()
-    {
-        save();
-
-        delete currentExperience;
-        currentExperience = nullptr;
-    }
-
-    void save()
-    {
-        if (!currentExperience || !currentExperience->has_new_exp() || (bool)Options["Experience Readonly"])
-            return;
-
-        currentExperience->save(currentExperience->filename(), false, false);
-    }
+        private:
+            GameConverter game;
 
-    const ExpEntryEx* probe(Key k)
-    {
-        assert(experienceEnabled);
-        if (!currentExperience)
-            return nullptr;
+            vector<string_view> tokens;
+            vector<string_view> fields;
+            string moveStr;
 
-        return currentExperience->probe(k);
-    }
+            bool convert_game(string_view compactPgn, vector<char>& out, ConversionStats& stats)
+            {
+                //Increment games counter
+                ++stats.numGames;
 
-    void wait_for_loading_finished()
-    {
-        if (!currentExperience)
-            return;
+                //Split compact PGN into its main three parts
+                split(compactPgn, ',', tokens);
 
-        currentExperience->wait_for_load_finished();
-    }
+                if (tokens.size() < 3)
+                {
+                    ++stats.numGamesWithErrors;
+                    return false;
+                }
 
-    //Defrag command:
-    //Format:  defrag [filename]
-    //Example: defrag C:\Path to\Experience\file.exp
-    //Note:    'filename' is optional. If omitted, then the default experience filename (Hypnos.exp) will be used
-    //         'filename' can contain spaces and can be a full path. If filename contains spaces, it is best to enclose it in quotations
-    void defrag(int argc, char* argv[])
-    {
-        //Make sure experience has finished loading
-        //Not exactly needed here, but the messages shown when exp loading finish will
-        //disturb the progress messages shown by this function
-        wait_for_loading_finished();
+                //Find winner color from result-string
+                Color winnerColor;
+                     if (tokens[1] == "w") winnerColor = WHITE;
+                else if (tokens[1] == "b") winnerColor = BLACK;
+                else if (tokens[1] == "d") winnerColor = COLOR_NB;
+                else                       return false;
 
-        if (argc != 1)
-        {
-            sync_cout << "info string Error : Incorrect defrag command" << sync_endl;
-            sync_cout << "info string Syntax: defrag [filename]" << sync_endl;
-            return;
-        }
+                game.start(string(tokens[0]), false, winnerColor);
 
-        string filename = Utility::map_path(Utility::unquote(argv[0]));
+                //////////////////////////////////////////////////////////////////
+                // Read moves
+                for (size_t i = 2; i < tokens.size(); ++i)
+                {
+                    //Get move, score and depth
+                    split(tokens[i], ':', fields);
+                    if (fields.empty() || fields.size() >= 4)
+                    {
+                        ++stats.numGamesWithErrors;
+                        return false;
+                    }
 
-        //Print message
-        sync_cout << "\nDefragmenting experience file: " << filename << sync_endl;
+                    //Cleanup move
+                    string_view move = fields[0];
+                    while (!move.empty() && (move.back() == '+' || move.back() == '#' || move.back() == '\r' || move.back() == '\n'))
+                        move.remove_suffix(1);
 
-        //Map filename
-        filename = Utility::map_path(filename);
+                    //Check if move is empty
+                    if (move.empty())
+                    {
+                        ++stats.numGamesWithErrors;
+                        return false;
+                    }
 
-        //Load
-        ExperienceData exp;
-        if (!exp.load(filename, true))
-            return;
+                    //Parse the move
+                    moveStr.assign(move);
+                    Move m = UCI::to_move(game.position(), moveStr);
+                    if (m == MOVE_NONE)
+                    {
+                        ++stats.numGamesWithErrors;
+                        return false;
+                    }
 
-        //Save
-        exp.save(filename, true, false);
-    }
+                    int depth = DEPTH_NONE;
+                    int score = VALUE_NONE;
+                    if (   (fields.size() >= 3 && !fields[2].empty() && !parse_int(fields[2], depth))
+                        || (fields.size() >= 2 && !fields[1].empty() && !parse_int(fields[1], score)))
+                    {
+                        ++stats.numGamesWithErrors;
+                        return false;
+                    }
 
-    //Merge command:
-    //Format:  merge filename filename1 filename2 ... filenameX
-    //Example: defrag "C:\Path to\Experience\file.exp"
-    //Note:    'filename' is the target filename, which will also merged with the rest of the files if it exists
-    //         'filename1' ... 'filenameX' are the names of the experience files to be merged (along with filename)
-    //         'filename' can contain spaces but in that case it needs to eb quoted. It can also be a full path
-    void merge(int argc, char* argv[])
-    {
-        //Make sure experience has finished loading
-        //Not exactly needed here, but the messages shown when exp loading finish will
-        //disturb the progress messages shown by this function
-        wait_for_loading_finished();
+                    if (!game.play(m, (Value)score, (Depth)depth, stats))
+                        return false;
+                }
 
-        //Step 1: Check
-        if (argc < 2)
-        {
-            sync_cout << "info string Error : Incorrect merge command" << sync_endl;
-            sync_cout << "info string Syntax: merge <filename> <filename1> [filename2] ... [filenameX]" << sync_endl;
-            sync_cout << "info string The first <filename> is also the target experience file which will contain all the merged data" << sync_endl;
-            sync_cout << "info string The files <filename1> ... <filenameX> are the other experience files to be merged" << sync_endl;
-            return;
-        }
+                return game.finish(out, stats);
+            }
 
-        //Step 2: Collect filenames
-        vector<string> filenames;
-        for (int i = 0; i < argc; ++i)
-            filenames.push_back(Utility::map_path(Utility::unquote(argv[i])));
+        public:
+            CompactPgnConverter(const ConversionSettings& settings) : game(settings)
+            {
+            }
 
-        //Step 3: The first filename is also the target filename
-        string targetFilename = filenames.front();
+            //Games are on a line of their own, so a chunk can end after any line
+            static size_t chunk_end(string_view input, size_t pos)
+            {
+                size_t eol = input.find('\n', pos);
+                return eol == string_view::npos ? input.size() : eol + 1;
+            }
 
-        //Print message
-        sync_cout << "\nMerging experience files: ";
-        for (const string& fn : filenames)
-            cout << "\n\t" << fn;
+            //Convert all the games of a chunk of input and append their experience entries to 'out'
+            void convert(string_view chunk, vector<char>& out, ConversionStats& stats)
+            {
+                while (!chunk.empty())
+                {
+                    size_t eol = chunk.find('\n');
+                    string_view line = chunk.substr(0, eol);
+                    chunk.remove_prefix(eol == string_view::npos ? chunk.size() : eol + 1);
 
-        cout << "\nTarget file: " << targetFilename << "\n" << sync_endl;
+                    if (!line.empty() && line.back() == '\r')
+                        line.remove_suffix(1);
 
-        //Step 4: Load and merge
-        ExperienceData exp;
-        for (const string& fn : filenames)
-            exp.load(fn, true);
+                    //Skip empty lines
+                    if (line.empty())
+                        continue;
 
-        exp.save(targetFilename, true, false);
-    }
+                    if (line.front() != '{' || line.back() != '}')
+                        continue;
 
-    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    //Convert compact PGN data to experience entries
-    //
-    //Compact PGN consists of the following format:
-    // {fen-string,w|b|d,move[:score:depth],move[:score:depth],move:score:depth[:score:depth],...}
-    //
-    // *) fen-string: Represents the start position of the game, which is not necesserly the normal start position
-    // *) w|b|d: Indicates the game result from PGN (to be validated), w= white win, b = black win, d = draw
-    // *) move[:score:depth]
-    //      - move : The move in long algebraic form, example e2e4
-    //      - score: The engine evaluation of the position from side to move point of view. This is an optional field
-    //      - depth: The depth of the move as read from engine evaluation. This is an optional field
-    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    void convert_compact_pgn(int argc, char* argv[])
-    {
-        //Make sure experience has finished loading
-        //Not exactly needed here, but the messages shown when exp loading finish will
-        //disturb the progress messages shown by this function
-        wait_for_loading_finished();
+                    convert_game(line.substr(1, line.size() - 2), out, stats);
+                }
+            }
+        };
 
-        if (argc < 2)
+        //Parse a move in standard algebraic notation, for example Nbd7, exd5, e8=Q or O-O
+        Move san_to_move(const Position& pos, string_view san)
         {
-            sync_cout << "Expecting at least 2 arguments, received: " << argc << sync_endl;
-            return;
-        }
+            //Strip check, mate and annotation symbols
+            while (!san.empty() && string_view("+#!?").find(san.back()) != string_view::npos)
+                san.remove_suffix(1);
 
-        //////////////////////////////////////////////////////////////////////////
-        // Collect input
-        string inputPath  = Utility::unquote(argv[0]);
-        string outputPath = Utility::unquote(argv[1]);
-        int maxPly     = argc >= 3 ? atoi(argv[2])        : 1000;
-        Value maxValue = argc >= 4 ? (Value)atoi(argv[3]) : (Value)VALUE_MATE;
-        Depth minDepth = argc >= 5 ? max((Depth)atoi(argv[4]), EXP_MIN_DEPTH) : EXP_MIN_DEPTH;
-        Depth maxDepth = argc >= 6 ? max((Depth)atoi(argv[5]), EXP_MIN_DEPTH) : (Depth)MAX_PLY;
-
-        sync_cout                                         << endl
-                  << "Building experience from PGN: "     << endl
-                  << "\tCompact PGN file: " << inputPath  << endl
-                  << "\tExperience file : " << outputPath << endl
-                  << "\tMax ply         : " << maxPly     << endl
-                  << "\tMax value       : " << maxValue   << endl
-                  << "\tDepth range     : " << minDepth   << " - " << maxDepth
-                                                          << endl << sync_endl;
-
-        //////////////////////////////////////////////////////////////////
-        //Conversion information
-        struct GLOBAL_COMPACT_PGN_CONVERSION_DATA
-        {
-            //Game statistics
-            size_t numGames = 0;
-            size_t numGamesWithErrors = 0;
-            size_t numGamesIgnored = 0;
+            //Castling
+            if (san == "O-O" || san == "0-0" || san == "O-O-O" || san == "0-0-0")
+            {
+                bool kingSide = san.size() == 3;
+                for (const auto& m : MoveList<LEGAL>(pos))
+                    if (type_of(m) == CASTLING && (to_sq(m) > from_sq(m)) == kingSide)
+                        return m;
 
-            //Move statistics
-            size_t numMovesWithScores = 0;
-            size_t numMovesWithScoresIgnored = 0;
-            size_t numMovesWithoutScores = 0;                        
+                return MOVE_NONE;
+            }
 
-            //WBD statistics
-            size_t wbd[COLOR_NB + 1] = { 0, 0, 0 };
+            constexpr string_view PieceChars = " PNBRQK";
 
-            //Input stream
-            fstream inputStream;
-            size_t inputStreamSize = 0;
+            //Promotion piece, with or without '='
+            PieceType promotion = NO_PIECE_TYPE;
+            if (san.size() > 2 && PieceChars.find(san.back()) >= size_t(KNIGHT) && PieceChars.find(san.back()) <= size_t(QUEEN))
+            {
+                promotion = PieceType(PieceChars.find(san.back()));
+                san.remove_suffix(1);
 
-            //Output stream
-            fstream outputStream;
-            size_t outputStreamBase;
+                if (san.back() == '=')
+                    san.remove_suffix(1);
+            }
 
-            //Buffer
-            vector<char> buffer;
-        }globalConversionData;
+            //Moving piece
+            PieceType pt = PAWN;
+            if (!san.empty() && PieceChars.find(san.front()) >= size_t(KNIGHT) && PieceChars.find(san.front()) != string_view::npos)
+            {
+                pt = PieceType(PieceChars.find(san.front()));
+                san.remove_prefix(1);
+            }
 
-        //////////////////////////////////////////////////////////////////
-        //Game conversion information
-        struct COMPACT_PGN_CONVERSION_DATA
-        {
-            Color detectedWinnerColor;
-            bool drawDetected;
-            int resultWeight[COLOR_NB + 1];
+            //Destination square
+            if (   san.size() < 2
+                || san[san.size() - 2] < 'a' || san[san.size() - 2] > 'h'
+                || san[san.size() - 1] < '1' || san[san.size() - 1] > '8')
+                return MOVE_NONE;
 
-            Position pos;
+            Square to = make_square(File(san[san.size() - 2] - 'a'), Rank(san[san.size() - 1] - '1'));
+            san.remove_suffix(2);
 
-            COMPACT_PGN_CONVERSION_DATA()
+            //Disambiguation and capture sign
+            int fromFile = -1;
+            int fromRank = -1;
+            for (char c : san)
             {
-                clear();
+                if (c >= 'a' && c <= 'h')
+                    fromFile = c - 'a';
+                else if (c >= '1' && c <= '8')
+                    fromRank = c - '1';
+                else if (c != 'x' && c != ':' && c != '-')
+                    return MOVE_NONE;
             }
 
-            void clear()
+            Move move = MOVE_NONE;
+            for (const auto& m : MoveList<LEGAL>(pos))
             {
-                detectedWinnerColor = COLOR_NB;
-                drawDetected = false;
-                memset((void*)&resultWeight, 0, sizeof(resultWeight));
+                Square from = from_sq(m);
+
+                if (   type_of(m) == CASTLING
+                    || to_sq(m) != to
+                    || type_of(pos.piece_on(from)) != pt
+                    || (type_of(m) == PROMOTION ? promotion_type(m) : NO_PIECE_TYPE) != promotion
+                    || (fromFile >= 0 && file_of(from) != fromFile)
+                    || (fromRank >= 0 && rank_of(from) != fromRank))
+                    continue;
+
+                //Ambiguous move
+                if (move != MOVE_NONE)
+                    return MOVE_NONE;
+
+                move = m;
             }
-        }gameData;
 
-        //////////////////////////////////////////////////////////////////////////
-        //Input stream
-        globalConversionData.inputStream.open(inputPath, ios::in | ios::ate);
-        if (!globalConversionData.inputStream.is_open())
-        {
-            sync_cout << "Could not open <" << inputPath << "> for reading" << sync_endl;
-            return;
+            return move;
         }
 
-        globalConversionData.inputStreamSize = globalConversionData.inputStream.tellg();
-        globalConversionData.inputStream.seekg(0, ios::beg);
-
-        //////////////////////////////////////////////////////////////////////////
-        //Output stream
-        globalConversionData.outputStream.open(outputPath, ios::out | ios::binary | ios::app | ios::ate);
-        if (!globalConversionData.outputStream.is_open())
+        //Parse an engine evaluation as written by GUIs at the start of move comments, for example {+0.35/18 1.2s}
+        //or {-M5/20}. The score is in pawns (or moves to mate) from the point of view of the side that played the move
+        bool parse_pgn_eval(string_view comment, Value& score, Depth& depth)
         {
-            sync_cout << "Could not open <" << outputPath << "> for writing" << sync_endl;
-            return;
-        }
+            comment.remove_prefix(std::min(comment.find_first_not_of(" \t\r\n"), comment.size()));
 
-        globalConversionData.outputStreamBase = globalConversionData.outputStream.tellp();
+            size_t slash = comment.find('/');
+            if (slash == string_view::npos)
+                return false;
 
-        //If the output file is a new file, then we need to write the signature
-        if (globalConversionData.outputStreamBase == 0)
-        {
-            globalConversionData.outputStream << Current::ExperienceSignature.c_str();
-            globalConversionData.outputStreamBase = globalConversionData.outputStream.tellp();
-        }
+            string_view scoreStr = comment.substr(0, slash);
+            int d;
+            if (!parse_int(comment.substr(slash + 1), d) || d <= 0)
+                return false;
 
-        //////////////////////////////////////////////////////////////////////////
-        //Buffer
-        globalConversionData.buffer.reserve(WriteBufferSize);
+            bool negative = !scoreStr.empty() && scoreStr.front() == '-';
+            if (!scoreStr.empty() && (scoreStr.front() == '-' || scoreStr.front() == '+'))
+                scoreStr.remove_prefix(1);
 
-        //////////////////////////////////////////////////////////////////
-        //Experience Data writing routine
-        auto write_data = [&](bool force)
-        {
-            if (force || globalConversionData.buffer.size() >= WriteBufferSize)
+            if (!scoreStr.empty() && scoreStr.front() == 'M')
             {
-                globalConversionData.outputStream.write(globalConversionData.buffer.data(), globalConversionData.buffer.size());
-                globalConversionData.buffer.clear();
+                //Moves to mate
+                int moves;
+                scoreStr.remove_prefix(1);
+                if (scoreStr.empty() || from_chars(scoreStr.data(), scoreStr.data() + scoreStr.size(), moves).ptr != scoreStr.data() + scoreStr.size() || moves <= 0)
+                    return false;
 
-                size_t numMoves = globalConversionData.numMovesWithScores + globalConversionData.numMovesWithScoresIgnored + globalConversionData.numMovesWithoutScores;
-                size_t inputStreamPos = globalConversionData.inputStream.tellg();
+                score = negative ? mated_in(2 * moves) : mate_in(2 * moves - 1);
+            }
+            else
+            {
+                //Pawns, with a decimal point so that other comments containing a '/' aren't taken for evaluations
+                size_t dot = scoreStr.find('.');
+                if (dot == string_view::npos || dot == 0 || dot + 1 == scoreStr.size() || scoreStr.find_first_not_of("0123456789.") != string_view::npos)
+                    return false;
 
-                //Fix for end-of-input stream value of -1!
-                if (inputStreamPos == (size_t)-1)
-                    inputStreamPos = globalConversionData.inputStreamSize;
+                int pawns, fraction;
+                string_view fractionStr = scoreStr.substr(dot + 1, 2);
+                if (   from_chars(scoreStr.data(), scoreStr.data() + dot, pawns).ptr != scoreStr.data() + dot
+                    || from_chars(fractionStr.data(), fractionStr.data() + fractionStr.size(), fraction).ptr != fractionStr.data() + fractionStr.size())
+                    return false;
 
-                sync_cout
-                    << fixed << setprecision(2) << setw(6) << setfill(' ') << ((double)inputStreamPos * 100.0 / (double)globalConversionData.inputStreamSize) << "% ->"
-                    << " Games: " << globalConversionData.numGames << " (errors: " << globalConversionData.numGamesWithErrors << "),"
-                    << " WBD: " << globalConversionData.wbd[WHITE] << "/" << globalConversionData.wbd[BLACK] << "/" << globalConversionData.wbd[COLOR_NB] << ","
-                    << " Moves: " << numMoves << " (" << globalConversionData.numMovesWithScores << " with scores, " << globalConversionData.numMovesWithoutScores << " without scores, " << globalConversionData.numMovesWithScoresIgnored << " ignored)."
-                    << " Exp size: " << format_bytes((size_t)globalConversionData.outputStream.tellp() - globalConversionData.outputStreamBase, 2)
-                    << sync_endl;
+                int64_t cp = (int64_t)pawns * 100 + (fractionStr.size() == 1 ? fraction * 10 : fraction);
+                int64_t v = std::min(cp * UCI::NormalizeToPawnValue / 100, (int64_t)VALUE_TB_WIN_IN_MAX_PLY - 1);
+                score = (Value)(negative ? -v : v);
             }
-        };
 
-        //////////////////////////////////////////////////////////////////
-        //Helper function for splitting strings
-        auto tokenize = [](const string& str, char delimiter) -> vector<string>
+            depth = (Depth)d;
+            return true;
+        }
+
+        //Converts PGN games, as exported by chess GUIs, in a single pass. The moves are in standard algebraic
+        //notation and the engine evaluations are read from the comments that follow them. Variations are
+        //skipped. Each conversion thread has its own converter
+        class PgnConverter
         {
-            istringstream iss(str);
-            vector<string> fields;
+        private:
+            enum class GameState
+            {
+                Tags,     //Between games: reading the tags of the next game
+                Moves,    //Converting the moves of a game
+                Skipping  //The game has an error or is to be ignored: skipping the rest of it
+            };
 
-            string field;
-            while (getline(iss, field, delimiter))
-                fields.push_back(field);
+            GameConverter game;
+            GameState state = GameState::Tags;
 
-            return fields;
-        };
+            //Tags of the game
+            string fen;
+            string result;
+            bool chess960 = false;
 
-        //////////////////////////////////////////////////////////////////
-        //Conversion routine
-        auto convert_compact_pgn_to_exp = [&](const string &compactPgn) -> bool
-        {
-            constexpr Value GOOD_SCORE = PawnValue * 3;
-            constexpr Value OK_SCORE = GOOD_SCORE / 2;
-            constexpr Value MAX_DRAW_SCORE = (Value)50;
-            constexpr int MIN_WEIGHT_FOR_DRAW = 8;
-            constexpr int MIN_WEIGHT_FOR_WIN = 16;
-            constexpr int MIN_PLY_PER_GAME = 16;
-            constexpr Bitboard DarkSquares = 0xAA55AA55AA55AA55ULL;
+            //Variation nesting level
+            int variation = 0;
 
-            //Clear current game data
-            gameData.clear();
+            //The last move read, which is played when its comment (if any) has been read
+            Move pendingMove = MOVE_NONE;
+            Value pendingScore = VALUE_NONE;
+            Depth pendingDepth = DEPTH_NONE;
+            bool pendingCommented = false;
 
-            //Increment games counter
-            ++globalConversionData.numGames;
+            void play_pending_move(ConversionStats& stats)
+            {
+                if (pendingMove == MOVE_NONE)
+                    return;
 
-            //Split compact PGN into its main three parts
-            vector<string> tokens = tokenize(compactPgn, ',');
+                if (!game.play(pendingMove, pendingScore, pendingDepth, stats))
+                    state = GameState::Skipping;
 
-            if (tokens.size() < 3)
-            {
-                ++globalConversionData.numGamesWithErrors;
-                return false;
+                pendingMove = MOVE_NONE;
             }
 
-            //////////////////////////////////////////////////////////////////
-            //Read FEN string
-            string fen = tokens[0];
+            void start_game(ConversionStats& stats)
+            {
+                //Increment games counter
+                ++stats.numGames;
+
+                //Find winner color from result tag
+                Color winnerColor;
+                     if (result == "1-0")     winnerColor = WHITE;
+                else if (result == "0-1")     winnerColor = BLACK;
+                else if (result == "1/2-1/2") winnerColor = COLOR_NB;
+                else
+                {
+                    state = GameState::Skipping;
+                    return;
+                }
+
+                game.start(fen.empty() ? StartFEN : fen, chess960, winnerColor);
+                state = GameState::Moves;
+            }
 
-            //Setup Position
-            StateListPtr states(new deque<StateInfo>(1));
-            gameData.pos.set(fen, false, &states->back(), Threads.main());
+            void end_game(vector<char>& out, ConversionStats& stats)
+            {
+                if (state == GameState::Moves)
+                {
+                    play_pending_move(stats);
 
-            //////////////////////////////////////////////////////////////////
-            //Read result
-            string resultStr = tokens[1];
+                    if (state == GameState::Moves)
+                        game.finish(out, stats);
+                }
 
-            //Find winner color from result-string
-            Color winnerColor;
-                 if (resultStr == "w") winnerColor = WHITE;
-            else if (resultStr == "b") winnerColor = BLACK;
-            else if (resultStr == "d") winnerColor = COLOR_NB;
-            else                       return false;
+                state = GameState::Tags;
+                fen.clear();
+                result.clear();
+                chess960 = false;
+                variation = 0;
+                pendingMove = MOVE_NONE;
+            }
 
-            //////////////////////////////////////////////////////////////////
-            // Read moves
-            int gamePly = 0;
-            Current::ExpEntry tempExp((Key)0, MOVE_NONE, VALUE_NONE, DEPTH_NONE);
-            vector<char> tempBuffer;
-            for (size_t i = 2; i < tokens.size(); ++i)
+            void read_tag(string_view name, string_view value, vector<char>& out, ConversionStats& stats)
             {
-                ++gamePly;
+                //A tag after the moves starts the next game
+                if (state != GameState::Tags)
+                    end_game(out, stats);
+
+                if (name == "FEN")
+                    fen = value;
+                else if (name == "Result")
+                    result = value;
+                else if (name == "Variant")
+                    chess960 = value.find("960") != string_view::npos || value.find("ischer") != string_view::npos;
+            }
 
-                //Get move and score
-                string _move;
-                string _score;
-                string _depth;
+            void read_comment(string_view comment)
+            {
+                //Only the first comment after a move of the main line can have its evaluation
+                if (pendingMove == MOVE_NONE || pendingCommented || variation)
+                    return;
 
-                vector<string> tok = tokenize(tokens[i], ':');
-                if (tok.size() >= 1) _move = tok[0];
-                if (tok.size() >= 2) _score = tok[1];
-                if (tok.size() >= 3) _depth = tok[2];
+                pendingCommented = true;
+                parse_pgn_eval(comment, pendingScore, pendingDepth);
+            }
 
-                if (tok.size() >= 4)
+            void read_symbol(string_view symbol, vector<char>& out, ConversionStats& stats)
+            {
+                //Game termination
+                if (symbol == "1-0" || symbol == "0-1" || symbol == "1/2-1/2" || symbol == "*")
                 {
-                    ++globalConversionData.numGamesWithErrors;
-                    return false;
+                    if (state == GameState::Tags)
+                        start_game(stats);
+
+                    end_game(out, stats);
+                    return;
                 }
 
-                //Cleanup move
-                while (_move.back() == '+' || _move.back() == '#' || _move.back() == '\r' || _move.back() == '\n')
-                    _move.pop_back();
+                if (variation)
+                    return;
 
-                //Check if move is empty
-                if (_move.empty())
+                //Move number indication, possibly followed by the move (1.e4)
+                if (symbol.front() >= '0' && symbol.front() <= '9')
                 {
-                    ++globalConversionData.numGamesWithErrors;
-                    return false;
+                    size_t dots = symbol.find_first_not_of("0123456789");
+                    if (dots == string_view::npos)
+                        return;
+
+                    if (symbol[dots] == '.')
+                    {
+                        symbol.remove_prefix(std::min(symbol.find_first_not_of('.', dots), symbol.size()));
+                        if (symbol.empty())
+                            return;
+                    }
                 }
 
-                //Parse the move
-                Move move = UCI::to_move(gameData.pos, _move);
-                if (move == MOVE_NONE)
+                if (state == GameState::Tags)
+                    start_game(stats);
+
+                if (state != GameState::Moves)
+                    return;
+
+                play_pending_move(stats);
+                if (state != GameState::Moves)
+                    return;
+
+                Move m = san_to_move(game.position(), symbol);
+                if (m == MOVE_NONE)
                 {
-                    ++globalConversionData.numGamesWithErrors;
-                    return false;
+                    ++stats.numGamesWithErrors;
+                    state = GameState::Skipping;
+                    return;
                 }
 
-                Depth depth = _depth.empty() ? DEPTH_NONE : (Depth)stoi(_depth);
-                Value score = _score.empty() ? VALUE_NONE : (Value)stoi(_score);
+                pendingMove = m;
+                pendingScore = VALUE_NONE;
+                pendingDepth = DEPTH_NONE;
+                pendingCommented = false;
+            }
 
-                if (depth != DEPTH_NONE && score != VALUE_NONE)
+        public:
+            PgnConverter(const ConversionSettings& settings) : game(settings)
+            {
+            }
+
+            //Games are split where a tag section starts after an empty line
+            static size_t chunk_end(string_view input, size_t pos)
+            {
+                for (size_t i = input.find("\n[", pos); i != string_view::npos; i = input.find("\n[", i + 1))
                 {
-                    if (depth >= minDepth && depth <= maxDepth && abs(score) <= maxValue)
-                    {
-                        ++globalConversionData.numMovesWithScores;
+                    size_t lineStart = input.rfind('\n', i - 1);
+                    lineStart = lineStart == string_view::npos ? 0 : lineStart + 1;
 
-                        //Assign to temporary experience
-                        tempExp.key = gameData.pos.key();
-                        tempExp.move = move;
-                        tempExp.value = score;
-                        tempExp.depth = depth;
+                    if (input.substr(lineStart, i - lineStart).find_first_not_of(" \t\r") == string_view::npos)
+                        return i + 1;
+                }
 
-                        //Add to global buffer
-                        const char* data = reinterpret_cast<const char*>(&tempExp);
-                        tempBuffer.insert(tempBuffer.end(), data, data + sizeof(tempExp));
-                    }
-                    else
+                return input.size();
+            }
+
+            //Convert all the games of a chunk of input and append their experience entries to 'out'
+            void convert(string_view chunk, vector<char>& out, ConversionStats& stats)
+            {
+                size_t i = 0;
+                while (i < chunk.size())
+                {
+                    const char c = chunk[i];
+                    const size_t eol = std::min(chunk.find('\n', i), chunk.size());
+
+                    if (isspace((unsigned char)c))
                     {
-                        ++globalConversionData.numMovesWithScoresIgnored;
+                        ++i;
                     }
-
-                    //////////////////////////////////////////////////////////////////
-                    //Guess game result and apply sanity checks (we can't trust PGN scores blindly)
-                    if (abs(score) >= VALUE_TB_WIN_IN_MAX_PLY)
+                    else if (c == ';' || (c == '%' && (i == 0 || chunk[i - 1] == '\n')))
                     {
-                        Color winnerColorBasedOnThisMove = score > 0 ? gameData.pos.side_to_move() : ~gameData.pos.side_to_move();
-                        if (gameData.detectedWinnerColor == COLOR_NB)
-                        {
-                            gameData.detectedWinnerColor = winnerColorBasedOnThisMove;
-                            if (gameData.detectedWinnerColor != winnerColor)
-                            {
-                                ++globalConversionData.numGamesIgnored;
-                                return false;
-                            }
-                        }
-                        else if (gameData.detectedWinnerColor != winnerColorBasedOnThisMove)
-                        {
-                            ++globalConversionData.numGamesIgnored;
-                            return false;
-                        }
+                        //Rest of line comment and escaped line
+                        i = eol;
                     }
-                    else if (gameData.pos.is_draw(gameData.pos.is_draw(gameData.pos.game_ply())))
+                    else if (c == '[')
                     {
-                        gameData.drawDetected = true;
+                        //Tag pair: [Name "Value"]
+                        size_t nameEnd = std::min(chunk.find_first_of(" \t\"]", i + 1), eol);
+                        size_t valueStart = chunk.find('"', nameEnd);
+                        size_t valueEnd = valueStart < eol ? chunk.find('"', valueStart + 1) : string_view::npos;
+                        if (valueEnd < eol)
+                            read_tag(chunk.substr(i + 1, nameEnd - i - 1), chunk.substr(valueStart + 1, valueEnd - valueStart - 1), out, stats);
+
+                        i = eol;
                     }
-
-                    //Detect score pattern
-                    if (abs(score) >= GOOD_SCORE)
+                    else if (c == '{')
                     {
-                        gameData.resultWeight[COLOR_NB] = 0;
-                        gameData.resultWeight[score > 0 ? gameData.pos.side_to_move() : ~gameData.pos.side_to_move()] += score < 0 ? 4 : 2;
-                        gameData.resultWeight[score > 0 ? ~gameData.pos.side_to_move() : gameData.pos.side_to_move()] = 0;
+                        size_t end = std::min(chunk.find('}', i + 1), chunk.size());
+                        read_comment(chunk.substr(i + 1, end - i - 1));
+                        i = end + 1;
                     }
-                    else if (abs(score) >= OK_SCORE)
+                    else if (c == '(' || c == ')')
                     {
-                        gameData.resultWeight[COLOR_NB] /= 2;
-                        gameData.resultWeight[score > 0 ? gameData.pos.side_to_move() : ~gameData.pos.side_to_move()] += score < 0 ? 2 : 1;
-                        gameData.resultWeight[score > 0 ? ~gameData.pos.side_to_move() : gameData.pos.side_to_move()] /= 2;
+                        variation = std::max(variation + (c == '(' ? 1 : -1), 0);
+                        ++i;
                     }
-                    else if (abs(score) <= MAX_DRAW_SCORE)
+                    else if (c == '$')
                     {
-                        gameData.resultWeight[COLOR_NB] += 2;
-                        gameData.resultWeight[WHITE] = 0;
-                        gameData.resultWeight[BLACK] = 0;
+                        //Numeric annotation glyph
+                        i = std::min(chunk.find_first_not_of("0123456789", i + 1), chunk.size());
                     }
                     else
                     {
-                        gameData.resultWeight[COLOR_NB] += 1;
-                        gameData.resultWeight[WHITE] /= 2;
-                        gameData.resultWeight[BLACK] /= 2;
+                        size_t end = std::min(chunk.find_first_of(" \t\r\n{}()[];$", i + 1), chunk.size());
+                        read_symbol(chunk.substr(i, end - i), out, stats);
+                        i = end;
                     }
                 }
-                else
-                {
-                    ++globalConversionData.numMovesWithoutScores;
-                }
 
-                //Do the move
-                states->emplace_back();
-                gameData.pos.do_move(move, states->back());
+                end_game(out, stats);
+            }
+        };
 
-                //////////////////////////////////////////////////////////////////
-                //Detect draw by insufficient material
-                if (!gameData.drawDetected)
+        //Convert the games of a file to experience entries with several threads. The file is mapped in memory
+        //and split in chunks of whole games, and the entries of the chunks are written in input order, so the
+        //output does not depend on the number of threads
+        template<typename Converter>
+        void convert_games(const ConversionSettings& settings)
+        {
+            //////////////////////////////////////////////////////////////////////////
+            //Input
+            Utility::FileMapping input;
+            if (!input.map(settings.inputPath, true))
+            {
+                sync_cout << "Could not open <" << settings.inputPath << "> for reading" << sync_endl;
+                return;
+            }
+
+            input.advise_sequential();
+
+            const string_view inputData(reinterpret_cast<const char*>(input.data()), input.data_size());
+
+            //////////////////////////////////////////////////////////////////////////
+            //Output stream
+            fstream outputStream(settings.outputPath, ios::out | ios::binary | ios::app | ios::ate);
+            if (!outputStream.is_open())
+            {
+                sync_cout << "Could not open <" << settings.outputPath << "> for writing" << sync_endl;
+                return;
+            }
+
+            size_t outputStreamBase = outputStream.tellp();
+
+            //If the output file is a new file, then we need to write the signature
+            if (outputStreamBase == 0)
+            {
+                outputStream << Current::ExperienceSignature.c_str();
+                outputStreamBase = outputStream.tellp();
+            }
+
+            //////////////////////////////////////////////////////////////////////////
+            //Split the input in chunks of whole games
+            vector<string_view> chunks;
+            for (size_t begin = 0; begin < inputData.size();)
+            {
+                size_t end = Converter::chunk_end(inputData, std::min(begin + ConversionChunkSize, inputData.size()));
+
+                chunks.push_back(inputData.substr(begin, end - begin));
+                begin = end;
+            }
+
+            //////////////////////////////////////////////////////////////////////////
+            //Conversion threads
+            struct ChunkResult
+            {
+                vector<char> entries;
+                ConversionStats stats;
+                bool done = false;
+            };
+
+            vector<ChunkResult> results(chunks.size());
+
+            const size_t threadCount = std::min((size_t)std::max(thread::hardware_concurrency(), 1U), chunks.size());
+            const size_t maxChunksAhead = threadCount * ConversionChunksPerThread;
+
+            mutex resultsMutex;
+            condition_variable resultsCondition;
+            size_t writtenChunks = 0;
+            atomic<size_t> nextChunk(0);
+
+            vector<thread> threads;
+            for (size_t t = 0; t < threadCount; ++t)
+            {
+                threads.emplace_back([&]()
                 {
-                    int num_pieces = gameData.pos.count<ALL_PIECES>();
+                    Converter converter(settings);
 
-                    if (num_pieces == 2) //KvK
-                    {
-                        gameData.drawDetected = true;
-                    }
-                    else if (num_pieces == 3 && (gameData.pos.count<BISHOP>() + gameData.pos.count<KNIGHT>()) == 1) //KvK + 1 minor piece
+                    for (size_t c = nextChunk++; c < chunks.size(); c = nextChunk++)
                     {
-                        gameData.drawDetected = true;
-                    }
-                    else if (num_pieces == 4 && gameData.pos.count<BISHOP>(WHITE) == 1 && gameData.pos.count<BISHOP>(BLACK) == 1) //KBvKB, bishops of the same color
-                    {
-                        if (
-                            ((gameData.pos.pieces(WHITE, BISHOP) & DarkSquares) && (gameData.pos.pieces(BLACK, BISHOP) & DarkSquares))
-                            || ((gameData.pos.pieces(WHITE, BISHOP) & ~DarkSquares) && (gameData.pos.pieces(BLACK, BISHOP) & ~DarkSquares)))
-                            gameData.drawDetected = true;
+                        //Don't get too far ahead of the writer, so memory use stays bounded
+                        {
+                            unique_lock<mutex> lock(resultsMutex);
+                            resultsCondition.wait(lock, [&]() { return c < writtenChunks + maxChunksAhead; });
+                        }
+
+                        converter.convert(chunks[c], results[c].entries, results[c].stats);
+
+                        {
+                            lock_guard<mutex> lock(resultsMutex);
+                            results[c].done = true;
+                        }
+
+                        resultsCondition.notify_all();
                     }
+                });
+            }
+
+            //////////////////////////////////////////////////////////////////
+            //Writer
+            ConversionStats stats;
+            size_t reportedSize = 0;
+            for (size_t c = 0; c < chunks.size(); ++c)
+            {
+                {
+                    unique_lock<mutex> lock(resultsMutex);
+                    resultsCondition.wait(lock, [&]() { return results[c].done; });
                 }
 
-                //If draw is detected but game result isn't draw then reject the game
-                if (gameData.drawDetected && gameData.detectedWinnerColor != COLOR_NB)
+                outputStream.write(results[c].entries.data(), results[c].entries.size());
+                stats.add(results[c].stats);
+                vector<char>().swap(results[c].entries);
+
                 {
-                    ++globalConversionData.numGamesIgnored;
-                    return false;
+                    lock_guard<mutex> lock(resultsMutex);
+                    ++writtenChunks;
                 }
+
+                resultsCondition.notify_all();
+
+                size_t outputSize = (size_t)outputStream.tellp() - outputStreamBase;
+                if (c + 1 < chunks.size() && outputSize - reportedSize < WriteBufferSize)
+                    continue;
+
+                reportedSize = outputSize;
+
+                size_t numMoves = stats.numMovesWithScores + stats.numMovesWithScoresIgnored + stats.numMovesWithoutScores;
+                size_t inputPos = size_t(chunks[c].data() + chunks[c].size() - inputData.data());
+
+                sync_cout
+                    << fixed << setprecision(2) << setw(6) << setfill(' ') << ((double)inputPos * 100.0 / (double)inputData.size()) << "% ->"
+                    << " Games: " << stats.numGames << " (errors: " << stats.numGamesWithErrors << "),"
+                    << " WBD: " << stats.wbd[WHITE] << "/" << stats.wbd[BLACK] << "/" << stats.wbd[COLOR_NB] << ","
+                    << " Moves: " << numMoves << " (" << stats.numMovesWithScores << " with scores, " << stats.numMovesWithoutScores << " without scores, " << stats.numMovesWithScoresIgnored << " ignored)."
+                    << " Exp size: " << format_bytes(outputSize, 2)
+                    << sync_endl;
             }
 
-            //Does the game have enough moves?
-            if (gamePly < MIN_PLY_PER_GAME)
+            for (thread& th : threads)
+                th.join();
+
+            //////////////////////////////////////////////////////////////////
+            //Defragment outouf file
+            if (stats.numMovesWithScores)
             {
-                ++globalConversionData.numGamesIgnored;
-                return false;
+                //If we don't close the output stream here then defragmentation will not be able to create a backup of the file!
+                outputStream.close();
+
+                sync_cout << "Conversion complete" << endl << endl << "Defragmenting: " << settings.outputPath << sync_endl;
+
+                ExperienceData exp;
+                if (!exp.load(settings.outputPath, true))
+                    return;
+
+                //Save
+                exp.save(settings.outputPath, true, false);
             }
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    //Convert compact PGN data to experience entries
+    //
+    //Compact PGN consists of the following format:
+    // {fen-string,w|b|d,move[:score:depth],move[:score:depth],move:score:depth[:score:depth],...}
+    //
+    // *) fen-string: Represents the start position of the game, which is not necesserly the normal start position
+    // *) w|b|d: Indicates the game result from PGN (to be validated), w= white win, b = black win, d = draw
+    // *) move[:score:depth]
+    //      - move : The move in long algebraic form, example e2e4
+    //      - score: The engine evaluation of the position from side to move point of view. This is an optional field
+    //      - depth: The depth of the move as read from engine evaluation. This is an optional field
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void convert_compact_pgn(int argc, char* argv[])
+    {
+        //Make sure experience has finished loading
+        //Not exactly needed here, but the messages shown when exp loading finish will
+        //disturb the progress messages shown by this function
+        wait_for_loading_finished();
+
+        ConversionSettings settings;
+        if (!read_conversion_settings(argc, argv, "Compact PGN file", settings))
+            return;
+
+        convert_games<CompactPgnConverter>(settings);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    //Convert PGN games to experience entries
+    //
+    //The moves are read in standard algebraic notation, and their engine evaluations from the comments
+    //that follow them, as written by chess GUIs: {score/depth ...}, where the score is in pawns (or M<n>
+    //for a mate in n moves) from the point of view of the side that played the move, for example
+    //{+0.35/18 1.2s} or {-M5/20}. The game result is read from the Result tag and validated the same
+    //way as for compact PGN
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void convert_pgn(int argc, char* argv[])
+    {
+        //Make sure experience has finished loading
+        wait_for_loading_finished();
+
+        ConversionSettings settings;
+        if (!read_conversion_settings(argc, argv, "PGN file", settings))
+            return;
+
+        convert_games<PgnConverter>(settings);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    //Experience pruning
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    namespace
+    {
+        //Positions reached from the start position within 'maxPly' plies by playing experience moves. Files
+        //learned from games against other engines only have the moves of one side: any move can be played
+        //in a position without experience, as long as it follows a position with experience
+        class ExpReachability
+        {
+        private:
+            const Current::ExpEntry* _first;
+            const Current::ExpEntry* _last;
+            const int                _maxPly;
 
-            //If winner isn't yet identified, check result weights and try to identify it
-            if (gameData.detectedWinnerColor == COLOR_NB)
+            //Lowest ply at which each reached position was found
+            SugaRKeyMap<int> _reached;
+
+            void walk(Position& pos, int ply, bool anyMove)
             {
-                if (gameData.resultWeight[WHITE] >= MIN_WEIGHT_FOR_WIN)
-                    gameData.detectedWinnerColor = WHITE;
-                else if (gameData.resultWeight[BLACK] >= MIN_WEIGHT_FOR_WIN)
-                    gameData.detectedWinnerColor = BLACK;
+                if (ply >= _maxPly)
+                    return;
+
+                const Key key = pos.key();
+                const Current::ExpEntry* exp = lower_bound(_first, _last, key, [](const Current::ExpEntry& e, Key k) { return e.key < k; });
+                if (exp == _last || exp->key != key)
+                {
+                    if (!anyMove)
+                        return;
+
+                    for (const auto& m : MoveList<LEGAL>(pos))
+                    {
+                        StateInfo st;
+                        pos.do_move(m, st);
+                        walk(pos, ply + 1, false);
+                        pos.undo_move(m);
+                    }
+
+                    return;
+                }
+
+                //Transpositions are walked again only when reached earlier in the game
+                auto it = _reached.find(key);
+                if (it != _reached.end() && it->second <= ply)
+                    return;
+
+                _reached[key] = ply;
+
+                for (; exp != _last && exp->key == key; ++exp)
+                {
+                    Move move = (Move)exp->move;
+                    if (!pos.pseudo_legal(move) || !pos.legal(move))
+                        continue;
+
+                    StateInfo st;
+                    pos.do_move(move, st);
+                    walk(pos, ply + 1, true);
+                    pos.undo_move(move);
+                }
             }
 
-            //////////////////////////////////////////////////////////////////
-            //More sanity checks
-            if (   (gameData.detectedWinnerColor != winnerColor)
-                || (winnerColor != COLOR_NB && gameData.resultWeight[winnerColor] < MIN_WEIGHT_FOR_WIN)
-                || (winnerColor == COLOR_NB && !gameData.drawDetected && gameData.resultWeight[COLOR_NB] < MIN_WEIGHT_FOR_DRAW))
+        public:
+            //'first' to 'last' are the entries of a file sorted by key
+            ExpReachability(const Current::ExpEntry* first, const Current::ExpEntry* last, int maxPly)
+                : _first(first), _last(last), _maxPly(maxPly)
             {
-                ++globalConversionData.numGamesIgnored;
-                return false;
             }
 
-            //Update WBD stats
-            ++globalConversionData.wbd[winnerColor];
+            vector<Key> positions()
+            {
+                StateInfo st;
+                Position pos;
+                pos.set(StartFEN, false, &st, Threads.main());
+
+                walk(pos, 0, true);
 
-            //Copy to global buffer
-            globalConversionData.buffer.insert(globalConversionData.buffer.end(), tempBuffer.begin(), tempBuffer.end());
+                vector<Key> keys;
+                keys.reserve(_reached.size());
+                for (const auto& p : _reached)
+                    keys.push_back(p.first);
 
-            return true;
+                sort(keys.begin(), keys.end());
+                return keys;
+            }
         };
+    }
 
-        //////////////////////////////////////////////////////////////////
-        //Loop
-        string line;
-        while (getline(globalConversionData.inputStream, line))
-        {
-            //Skip empty lines
-            if (line.empty())
-                continue;
+    //Prune command:
+    //Format:  exp_prune <filename> <target> [minDepth] [minCount] [maxPly] [maxMoves] [version]
+    //Example: exp_prune "C:\Path to\Experience\file.exp" "C:\Path to\Experience\pruned.exp" 20 2 40 4
+    //Note:    Writes the moves of 'filename' with at least 'minDepth' and 'minCount' to a new experience file 'target'.
+    //         Zero means no limit for the other settings:
+    //         'maxPly'  : only the positions reached from the start position within 'maxPly' plies by playing
+    //                     experience moves are kept (the file does not record the game ply of a position). Any move
+    //                     of the opponent is tried when it is not in the experience
+    //         'maxMoves': only the best 'maxMoves' moves of a position are kept
+    //         'version' : 2 (plain) or 4 (compressed). If omitted, a compressed file stays compressed
+    //         The file is processed in sorted runs on disk, never loaded as a whole
+    void prune(int argc, char* argv[])
+    {
+        //Make sure experience has finished loading
+        wait_for_loading_finished();
 
-            if (line.front() != '{' || line.back() != '}')
-                continue;
+        int version = argc == 7 ? atoi(argv[6]) : 0;
+        if (argc < 2 || argc > 7 || (argc == 7 && version != Current::ExperienceVersion && version != V4::ExperienceVersion))
+        {
+            sync_cout << "info string Error : Incorrect exp_prune command" << sync_endl;
+            sync_cout << "info string Syntax: exp_prune <filename> <target> [minDepth] [minCount] [maxPly] [maxMoves] [version]" << sync_endl;
+            return;
+        }
 
-            line = line.substr(1, line.size() - 2);
+        string filename = Utility::map_path(Utility::unquote(argv[0]));
+        string target   = Utility::map_path(Utility::unquote(argv[1]));
+        Depth  minDepth = argc >= 3 ? max((Depth)atoi(argv[2]), EXP_MIN_DEPTH) : EXP_MIN_DEPTH;
+        int    minCount = argc >= 4 ? max(atoi(argv[3]), 0) : 0;
+        int    maxPly   = argc >= 5 ? max(atoi(argv[4]), 0) : 0;
+        int    maxMoves = argc >= 6 ? max(atoi(argv[5]), 0) : 0;
+
+        int fileVersion = 0;
+        size_t entries = 0;
+        if (!experience_file_info(filename, fileVersion, entries))
+        {
+            sync_cout << "info string The file [" << filename << "] is not a valid experience file" << sync_endl;
+            return;
+        }
 
-            if (convert_compact_pgn_to_exp(line))
-                write_data(false);
+        if (Utility::file_exists(target) && Utility::is_same_file(filename, target))
+        {
+            sync_cout << "info string The pruned experience must be written to a new file" << sync_endl;
+            return;
         }
 
-        //Final commit
-        write_data(true);
+        if (!version)
+            version = fileVersion == V4::ExperienceVersion ? V4::ExperienceVersion : Current::ExperienceVersion;
 
-        //////////////////////////////////////////////////////////////////
-        //Defragment outouf file
-        if (globalConversionData.numMovesWithScores)
-        {
-            //If we don't close the output stream here then defragmentation will not be able to create a backup of the file!
-            globalConversionData.outputStream.close();
+        sync_cout                                                           << endl
+                  << "Pruning experience file: "                            << endl
+                  << "\tExperience file : " << filename                     << endl
+                  << "\tTarget file     : " << target                       << endl
+                  << "\tMin depth       : " << minDepth                     << endl
+                  << "\tMin count       : " << minCount                     << endl
+                  << "\tMax ply         : " << (maxPly ? to_string(maxPly) : string("none")) << endl
+                  << "\tMax moves       : " << (maxMoves ? to_string(maxMoves) : string("all")) << endl
+                  << "\tVersion         : " << version                      << sync_endl;
 
-            sync_cout << "Conversion complete" << endl << endl << "Defragmenting: " << outputPath << sync_endl;
+        entries = max(entries, (size_t)(Utility::get_file_size(filename) / sizeof(Current::ExpEntry)));
 
-            ExperienceData exp;
-            if (!exp.load(outputPath, true))
+        //Step 1: Move pruning. With a ply horizon, the result is a plain file sorted by key, which is walked next
+        string movesFilename = maxPly ? target + ".moves" : target;
+        {
+            ExpRunMerger merger(movesFilename, entries);
+            merger.set_version(maxPly ? Current::ExperienceVersion : version);
+            merger.set_pruning(minDepth, minCount, maxMoves ? (size_t)maxMoves : ExpPositionBuilder::MaxMoves);
+
+            if (!merger.add_file(filename) || !merger.merge())
+            {
+                sync_cout << "info string Failed to prune experience file [" << filename << "]" << sync_endl;
                 return;
+            }
+        }
+
+        //Step 2: Position pruning
+        if (maxPly)
+        {
+            vector<Key> positions;
+            {
+                Utility::FileMapping file;
+                if (!file.map(movesFilename, true))
+                {
+                    remove(movesFilename.c_str());
+                    return;
+                }
+
+                const Current::ExpEntry* first = reinterpret_cast<const Current::ExpEntry*>(file.data() + Current::ExperienceSignature.size());
+                const Current::ExpEntry* last = first + (file.data_size() - Current::ExperienceSignature.size()) / sizeof(Current::ExpEntry);
+
+                positions = ExpReachability(first, last, maxPly).positions();
+            }
+
+            sync_cout << "info string " << positions.size() << " position(s) reached within " << maxPly << " plies" << sync_endl;
+
+            ExpRunMerger merger(target, entries);
+            merger.set_version(version);
+            merger.set_positions(&positions);
 
-            //Save
-            exp.save(outputPath, true, false);
+            bool success = merger.add_file(movesFilename) && merger.merge();
+            remove(movesFilename.c_str());
+            remove((movesFilename + ".bak").c_str());
+
+            if (!success)
+            {
+                sync_cout << "info string Failed to prune experience file [" << filename << "]" << sync_endl;
+                return;
+            }
         }
+
+        sync_cout << "info string Pruned experience file [" << filename << "] from " << format_bytes(Utility::get_file_size(filename), 2)
+                  << " to " << format_bytes(Utility::get_file_size(target), 2) << sync_endl;
     }
 
     void show_exp(Position& pos, bool extended)
@@ -1557,6 +5880,9 @@ namespace Experience
         //Make sure experience has finished loading
         wait_for_loading_finished();
 
+        //Keep the experience from being replaced while showing it
+        lock_guard<mutex> lock(experienceMutex);
+
         sync_cout << pos << endl;
 
         cout << "Experience: ";
@@ -1573,7 +5899,7 @@ namespace Experience
         while (temp)
         {
             quality.emplace_back(temp, temp->quality(pos, evalImportance).first);
-            temp = temp->next;
+            temp = temp->next();
         }
 
         //Sort experience moves based on quality
@@ -1607,7 +5933,7 @@ namespace Experience
 
             cout << endl;
 
-            expEx = expEx->next;
+            expEx = expEx->next();
         }
 
         cout << sync_endl;
@@ -1630,22 +5956,28 @@ namespace Experience
 
     void add_pv_experience(Key k, Move m, Value v, Depth d)
     {
-        if (!currentExperience)
+        lock_guard<mutex> lock(experienceMutex);
+
+        ExperienceData* exp = currentExperience.load(memory_order_relaxed);
+        if (!exp)
             return;
 
         assert((bool)Options["Experience Readonly"] == false);
 
-        currentExperience->add_pv_experience(k, m, v, d);
+        exp->add_pv_experience(k, m, v, d);
     }
 
     void add_multipv_experience(Key k, Move m, Value v, Depth d)
     {
-        if (!currentExperience)
+        lock_guard<mutex> lock(experienceMutex);
+
+        ExperienceData* exp = currentExperience.load(memory_order_relaxed);
+        if (!exp)
             return;
 
         assert((bool)Options["Experience Readonly"] == false);
 
-        currentExperience->add_multipv_experience(k, m, v, d);
+        exp->add_multipv_experience(k, m, v, d);
     }
 }
 
@@ -154,16 +154,25 @@ namespace Experience
 
     namespace Current = V2;
 
-    //Experience structure
+    //Experience structure. The moves of a position are stored next to each other, best move first,
+    //so the move following an entry is the next entry in memory (unless it is the last move)
     struct ExpEntryEx : public Current::ExpEntry
     {
-        ExpEntryEx* next = nullptr;
-
         ExpEntryEx() = delete;
         ExpEntryEx(const ExpEntryEx& exp) = delete;
         ExpEntryEx& operator =(const ExpEntryEx& exp) = delete;
 
-        explicit ExpEntryEx(Stockfish::Key k, Stockfish::Move m, Stockfish::Value v, Stockfish::Depth d, uint8_t c) : Current::ExpEntry(k, m, v, d, c) {}
+        explicit ExpEntryEx(Stockfish::Key k, Stockfish::Move m, Stockfish::Value v, Stockfish::Depth d, uint16_t c) : Current::ExpEntry(k, m, v, d, c) {}
+
+        ExpEntryEx* next() const
+        {
+            return (padding[0] & HasNext) ? const_cast<ExpEntryEx*>(this + 1) : nullptr;
+        }
+
+        void set_has_next(bool hasNext)
+        {
+            padding[0] = hasNext ? HasNext : 0;
+        }
 
         ExpEntryEx* find(Stockfish::Move m) const
         {
@@ -173,7 +182,7 @@ namespace Experience
                 if (exp->move == m)
                     return exp;
 
-                exp = exp->next;
+                exp = exp->next();
             } while (exp);
 
             return nullptr;
@@ -192,19 +201,31 @@ namespace Experience
                     break;
                 }
 
-                temp = temp->next;
+                temp = temp->next();
             } while (temp);
 
             return temp;
         }
 
         std::pair<int, bool> quality(Stockfish::Position& pos, int evalImportance) const;
+
+        //Experience moves played ahead by quality(), which also bounds the positions it probes
+        static constexpr int QualityMovesAhead = 10;
+
+    private:
+        std::pair<int, bool> compute_quality(Stockfish::Position& pos, int evalImportance, Stockfish::Key* probed, int& probedCount) const;
+
+        //Kept in the (otherwise unused) padding of the entry: another move of the same position follows
+        static constexpr uint8_t HasNext = 0x01;
     };
+
+    static_assert(sizeof(ExpEntryEx) == sizeof(Current::ExpEntry));
 }
 
 namespace Experience
 {
     void init();
+    void reload();
     bool enabled();
 
     void unload();
@@ -214,10 +235,37 @@ namespace Experience
 
     const ExpEntryEx* probe(Stockfish::Key k);
 
+    //Same, but nullptr is also returned (without reading the moves) if no move has at least the given depth
+    const ExpEntryEx* probe(Stockfish::Key k, Stockfish::Depth minDepth);
+
+    //Best experience move of a position
+    struct ExpBest
+    {
+        Stockfish::Move  move;
+        Stockfish::Value value;
+        Stockfish::Depth depth;
+    };
+
+    //Best move of position 'k', read from the index alone when it is known there. False if the position has no experience
+    bool probe_best(Stockfish::Key k, ExpBest& best);
+    void prefetch(Stockfish::Key k);
+
+    //Search threads probe a copy of the experience index placed on their NUMA node
+    void set_numa_replicas(bool enabled);
+
+    //Search threads only use the experience between attach_search_thread() and their next quiescent point, or
+    //detach_search_thread(): experience replaced by a reload is deleted once all of them got there
+    void attach_search_thread();
+    void quiescent_point();
+    void detach_search_thread();
+
     void defrag(int argc, char* argv[]);
     void merge(int argc, char* argv[]);
+    void stats(int argc, char* argv[]);
+    void prune(int argc, char* argv[]);
     void show_exp(Stockfish::Position& pos, bool extended);
     void convert_compact_pgn(int argc, char* argv[]);
+    void convert_pgn(int argc, char* argv[]);
 
     void pause_learning();
     void resume_learning();
@@ -49,17 +49,24 @@ using fun5_t = WORD(*)();
 using fun6_t = bool(*)(HANDLE, DWORD, PHANDLE);
 using fun7_t = bool(*)(LPCSTR, LPCSTR, PLUID);
 using fun8_t = bool(*)(HANDLE, BOOL, PTOKEN_PRIVILEGES, DWORD, PTOKEN_PRIVILEGES, PDWORD);
+using fun9_t = void(*)(PPROCESSOR_NUMBER);
+using fun10_t = bool(*)(PPROCESSOR_NUMBER, PUSHORT);
 }
 #endif
 
 #include <atomic>
+#include <cctype>
+#include <cinttypes>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <mutex>
+#include <set>
 #include <sstream>
 #include <string_view>
 #include <stdarg.h>
@@ -80,7 +87,11 @@ using fun8_t = bool(*)(HANDLE, BOOL, PTOKEN_PRIVILEGES, DWORD, PTOKEN_PRIVILEGES
 #include "types.h"
 
 #if defined(__linux__) && !defined(__ANDROID__)
+#include <linux/mempolicy.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #endif
 
 #if defined(__APPLE__) || defined(__ANDROID__) || defined(__OpenBSD__) || (defined(__GLIBCXX__) && !defined(_GLIBCXX_HAVE_ALIGNED_ALLOC) && !defined(_WIN32)) || defined(__e2k__)
@@ -987,6 +998,11 @@ namespace SysInfo
 
         return format_bytes(totalMemory, 0);
     }
+
+    uint64_t total_memory_bytes()
+    {
+        return totalMemory;
+    }
 }
 
 /// Debug functions used mainly to collect run-time statistics
@@ -1235,11 +1251,21 @@ static void* aligned_large_pages_alloc_windows([[maybe_unused]] size_t allocSize
   #endif
 }
 
+// Blocks allocated with large pages
+static std::mutex largePagesMutex;
+static std::set<const void*> largePageBlocks;
+
 void* aligned_large_pages_alloc(size_t allocSize) {
 
   // Try to allocate large pages
   void* mem = aligned_large_pages_alloc_windows(allocSize);
 
+  if (mem)
+  {
+      std::lock_guard<std::mutex> lock(largePagesMutex);
+      largePageBlocks.insert(mem);
+  }
+
   // Fall back to regular, page aligned, allocation if necessary
   if (!mem)
      {
@@ -1264,8 +1290,59 @@ void* aligned_large_pages_alloc(size_t allocSize) {
 
 #else
 
+#if defined(__linux__) && !defined(__ANDROID__) && defined(MAP_HUGETLB)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// Blocks mapped from the hugetlb pool, with their size and page size
+struct HugeTlbBlock {
+  size_t size;
+  size_t pageSize;
+};
+
+static std::mutex hugeTlbMutex;
+static std::map<const void*, HugeTlbBlock> hugeTlbBlocks;
+
+// Explicit huge pages, reserved by the administrator (vm.nr_hugepages or hugepages= boot option).
+// Unlike transparent huge pages, they never silently fall back to 4KB pages once allocated.
+static void* aligned_large_pages_alloc_hugetlb(size_t allocSize) {
+
+  // Page sizes as powers of two: 1GB, then 2MB
+  constexpr int pageShifts[] = { 30, 21 };
+
+  for (int pageShift : pageShifts)
+  {
+      const size_t pageSize = size_t(1) << pageShift;
+
+      // Whole pages are reserved: use them only when little of the last one is left unused
+      size_t size = (allocSize + pageSize - 1) / pageSize * pageSize;
+      if (allocSize < pageSize || size - allocSize > allocSize / 16)
+          continue;
+
+      int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (pageShift << MAP_HUGE_SHIFT);
+      void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (mem == MAP_FAILED)
+          continue;
+
+      std::lock_guard<std::mutex> lock(hugeTlbMutex);
+      hugeTlbBlocks[mem] = { size, pageSize };
+      return mem;
+  }
+
+  return nullptr;
+}
+
+#endif
+
 void* aligned_large_pages_alloc(size_t allocSize) {
 
+#if defined(__linux__) && !defined(__ANDROID__) && defined(MAP_HUGETLB)
+  if (void* mem = aligned_large_pages_alloc_hugetlb(allocSize))
+      return mem;
+#endif
+
 #if defined(__linux__)
   constexpr size_t alignment = 2 * 1024 * 1024; // assumed 2MB page size
 #else
@@ -1290,6 +1367,12 @@ void* aligned_large_pages_alloc(size_t allocSize) {
 
 void aligned_large_pages_free(void* mem) {
 
+  if (mem)
+  {
+      std::lock_guard<std::mutex> lock(largePagesMutex);
+      largePageBlocks.erase(mem);
+  }
+
   if (mem && !VirtualFree(mem, 0, MEM_RELEASE))
   {
       DWORD err = GetLastError();
@@ -1303,18 +1386,278 @@ void aligned_large_pages_free(void* mem) {
 #else
 
 void aligned_large_pages_free(void *mem) {
+
+#if defined(__linux__) && !defined(__ANDROID__) && defined(MAP_HUGETLB)
+  if (mem)
+  {
+      std::lock_guard<std::mutex> lock(hugeTlbMutex);
+
+      auto it = hugeTlbBlocks.find(mem);
+      if (it != hugeTlbBlocks.end())
+      {
+          munmap(mem, it->second.size);
+          hugeTlbBlocks.erase(it);
+          return;
+      }
+  }
+#endif
+
   std_aligned_free(mem);
 }
 
 #endif
 
 
+/// large_pages_info() describes the pages which back memory allocated with aligned_large_pages_alloc()
+
+std::string large_pages_info([[maybe_unused]] const void* mem) {
+
+#if defined(_WIN32)
+
+  std::lock_guard<std::mutex> lock(largePagesMutex);
+
+  return largePageBlocks.count(mem) ? format_bytes(GetLargePageMinimum(), 0) + " large pages"
+                                    : std::string("4KB pages (large pages not available)");
+
+#elif defined(__linux__) && !defined(__ANDROID__)
+
+#if defined(MAP_HUGETLB)
+  {
+      std::lock_guard<std::mutex> lock(hugeTlbMutex);
+
+      auto it = hugeTlbBlocks.find(mem);
+      if (it != hugeTlbBlocks.end())
+          return format_bytes(it->second.pageSize, 0) + " huge pages";
+  }
+#endif
+
+  // Transparent huge pages: the share of the mapping which is currently backed by them
+  std::ifstream smaps("/proc/self/smaps");
+  std::string   line;
+  bool          inMapping = false;
+  uint64_t      sizeKB = 0, hugeKB = 0;
+
+  while (std::getline(smaps, line))
+  {
+      unsigned long long start, end;
+      if (sscanf(line.c_str(), "%llx-%llx ", &start, &end) == 2)
+      {
+          if (inMapping)
+              break;
+
+          inMapping = uintptr_t(mem) >= start && uintptr_t(mem) < end;
+      }
+      else if (inMapping)
+      {
+          sscanf(line.c_str(), "Size: %" SCNu64 " kB", &sizeKB);
+          sscanf(line.c_str(), "AnonHugePages: %" SCNu64 " kB", &hugeKB);
+      }
+  }
+
+  if (!sizeKB)
+      return "4KB pages";
+
+  return hugeKB >= sizeKB ? std::string("2MB transparent huge pages")
+                          : "4KB pages (" + std::to_string(hugeKB * 100 / sizeKB) + "% in transparent huge pages)";
+
+#else
+
+  return "default pages";
+
+#endif
+}
+
+
 namespace WinProcGroup {
 
 #ifndef _WIN32
 
+#if defined(__linux__) && !defined(__ANDROID__)
+
+/// read_cpu_list() reads a list of processors as written by the kernel in sysfs, like "0-7,16-23"
+
+static std::vector<int> read_cpu_list(const std::string& path) {
+
+  std::vector<int> cpus;
+  std::ifstream in(path);
+  std::string range;
+
+  while (std::getline(in, range, ','))
+  {
+      int first, last;
+      int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+      if (n < 1)
+          continue;
+
+      for (int cpu = first; cpu <= (n == 2 ? last : first); ++cpu)
+          cpus.push_back(cpu);
+  }
+
+  return cpus;
+}
+
+/// allowed_cpus() returns the processors the process may run on, as restricted by
+/// taskset or a cpuset. It is read by the first thread to bind itself, before doing so.
+
+static const cpu_set_t& allowed_cpus() {
+
+  static const cpu_set_t allowed = [] {
+      cpu_set_t mask;
+      if (sched_getaffinity(0, sizeof(mask), &mask))
+      {
+          CPU_ZERO(&mask);
+          for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+              CPU_SET(cpu, &mask);
+      }
+      return mask;
+  }();
+
+  return allowed;
+}
+
+/// node_cpus() returns the processors of a node the process may run on
+
+static std::vector<int> node_cpus(size_t node) {
+
+  std::vector<int> cpus;
+  for (int cpu : read_cpu_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed_cpus()))
+          cpus.push_back(cpu);
+
+  return cpus;
+}
+
+/// best_node() returns the best node id for the thread with index idx, the same
+/// way as on Windows: the physical cores of a node are filled before moving on to
+/// the next node, then the other logical processors are spread evenly across nodes.
+
+static int best_node(size_t idx) {
+
+  std::vector<int> groups, smtGroups;
+  std::vector<int> nodes;
+
+  for (size_t n = 0; n < node_count(); ++n)
+  {
+      std::vector<int> cpus = node_cpus(n);
+      if (cpus.empty())
+          continue;
+
+      nodes.push_back(int(n));
+
+      // A processor is a physical core if it is the first of its siblings
+      for (int cpu : cpus)
+      {
+          std::vector<int> siblings = read_cpu_list("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list");
+          if (siblings.empty() || siblings[0] == cpu)
+              groups.push_back(int(n));
+          else
+              smtGroups.push_back(int(n));
+      }
+  }
+
+  if (nodes.size() <= 1)
+      return -1;
+
+  for (size_t t = 0; t < smtGroups.size(); ++t)
+      groups.push_back(nodes[t % nodes.size()]);
+
+  // If we still have more threads than the total number of logical processors
+  // then return -1 and let the OS to decide what to do.
+  return idx < groups.size() ? groups[idx] : -1;
+}
+
+/// bindThisThread() sets the affinity of the current thread to the processors of its node
+
+void bindThisThread(size_t idx) {
+
+  int node = best_node(idx);
+
+  if (node == -1)
+      return;
+
+  std::vector<int> cpus = node_cpus(size_t(node));
+  if (cpus.empty())
+      return;
+
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+
+  for (int cpu : cpus)
+      CPU_SET(cpu, &mask);
+
+  if (!sched_setaffinity(0, sizeof(mask), &mask))
+      sync_cout << "info string Binding thread " << idx << " to node " << node << sync_endl;
+}
+
+/// interleave() spreads the pages of a memory block over all the NUMA nodes, so that
+/// threads of all the nodes share the memory bandwidth. It must be called before the
+/// memory is first written.
+
+bool interleave(void* mem, size_t size) {
+
+  const size_t nodes = node_count();
+  if (nodes <= 1)
+      return false;
+
+  std::vector<unsigned long> nodeMask((nodes + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long)), 0);
+  for (size_t n = 0; n < nodes; ++n)
+      nodeMask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+
+  // The range must start on a page boundary
+  uintptr_t start = uintptr_t(mem) & ~uintptr_t(4095);
+  size += uintptr_t(mem) - start;
+
+  return syscall(SYS_mbind, start, size, MPOL_INTERLEAVE, nodeMask.data(), nodes + 1, 0) == 0;
+}
+
+/// node_count() returns the number of NUMA nodes of the machine, as listed by
+/// the kernel in sysfs (node directories may not be numbered contiguously)
+
+size_t node_count() {
+
+  size_t nodes = 1;
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (!dir)
+      return nodes;
+
+  while (struct dirent* entry = readdir(dir))
+      if (!strncmp(entry->d_name, "node", 4) && isdigit(entry->d_name[4]))
+          nodes = std::max(nodes, size_t(atoi(entry->d_name + 4)) + 1);
+
+  closedir(dir);
+  return nodes;
+}
+
+/// current_node() returns the NUMA node of the processor running the calling thread
+
+int current_node() {
+
+  unsigned cpu, node;
+  return syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 ? int(node) : 0;
+}
+
+/// lower_priority() lets the current thread run only on processors which would otherwise be idle
+
+void lower_priority() {
+
+  struct sched_param param{};
+  sched_setscheduler(0, SCHED_IDLE, &param);
+}
+
+#else
+
 void bindThisThread(size_t) {}
 
+void lower_priority() {}
+
+bool interleave(void*, size_t) { return false; }
+
+size_t node_count() { return 1; }
+
+int current_node() { return 0; }
+
+#endif
+
 #else
 
 /// best_node() retrieves logical processor information using Windows specific
@@ -1431,6 +1774,48 @@ void bindThisThread(size_t idx) {
   }
 }
 
+
+/// node_count() returns the number of NUMA nodes of the machine
+
+size_t node_count() {
+
+  ULONG highestNode;
+  return GetNumaHighestNodeNumber(&highestNode) ? size_t(highestNode) + 1 : 1;
+}
+
+
+/// interleave() is not supported: Windows places the pages on the node of the thread
+/// which first writes them, so the table is zeroed by threads bound to all the nodes.
+
+bool interleave(void*, size_t) { return false; }
+
+
+/// lower_priority() lets the current thread run only on processors which would otherwise be idle
+
+void lower_priority() {
+
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+}
+
+
+/// current_node() returns the NUMA node of the processor running the calling thread
+
+int current_node() {
+
+  // Early exit if the needed API are not available at runtime
+  HMODULE k32 = GetModuleHandle(TEXT("Kernel32.dll"));
+  auto fun9 = fun9_t((void(*)())GetProcAddress(k32, "GetCurrentProcessorNumberEx"));
+  auto fun10 = fun10_t((void(*)())GetProcAddress(k32, "GetNumaProcessorNodeEx"));
+
+  if (!fun9 || !fun10)
+      return 0;
+
+  PROCESSOR_NUMBER processor;
+  USHORT node;
+  fun9(&processor);                                                              // GetCurrentProcessorNumberEx
+  return fun10(&processor, &node) ? int(node) : 0;                               // GetNumaProcessorNodeEx
+}
+
 #endif
 
 } // namespace WinProcGroup
@@ -1619,6 +2004,16 @@ namespace Utility
         return (size_t)in.tellg();
     }
 
+    //Last modification time of a file, zero if it does not exist
+    int64_t get_file_time(const string& f)
+    {
+        struct stat info;
+        if (stat(map_path(f).c_str(), &info) == 0)
+            return (int64_t)info.st_mtime;
+
+        return 0;
+    }
+
     bool is_same_file(const string& f1, const string& f2)
     {
         return map_path(f1) == map_path(f2);
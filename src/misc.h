@@ -58,6 +58,7 @@ void* std_aligned_alloc(size_t alignment, size_t size);
 void std_aligned_free(void* ptr);
 void* aligned_large_pages_alloc(size_t size); // memory aligned by page size, min alignment: 4096 bytes
 void aligned_large_pages_free(void* mem); // nop if mem == nullptr
+std::string large_pages_info(const void* mem); // page size backing memory from aligned_large_pages_alloc()
 
 void dbg_hit_on(bool cond, int slot = 0);
 void dbg_mean_of(int64_t value, int slot = 0);
@@ -172,6 +173,10 @@ inline uint64_t mul_hi64(uint64_t a, uint64_t b) {
 
 namespace WinProcGroup {
   void bindThisThread(size_t idx);
+  void lower_priority();
+  bool interleave(void* mem, size_t size);
+  size_t node_count();
+  int current_node();
 }
 
 namespace CommandLine {
@@ -195,6 +200,7 @@ namespace SysInfo
     const std::string is_hyper_threading();
     const std::string cache_info(int idx);
     const std::string total_memory();
+    uint64_t total_memory_bytes();
 }
 
 class Position; //Needed by is_game_decided
@@ -224,6 +230,7 @@ namespace Utility
     std::string map_path(const std::string& p);
 
     size_t get_file_size(const std::string& f);
+    int64_t get_file_time(const std::string& f);
     bool is_same_file(const std::string& f1, const std::string& f2);
 
     std::string format_bytes(uint64_t bytes, int decimals);
@@ -377,6 +384,15 @@ namespace Utility
             dataSize = 0;
         }
 
+        //The data will be read from start to end (the mapping is made for random access otherwise)
+        void advise_sequential() const
+        {
+#if !defined(_WIN32) && defined(MADV_SEQUENTIAL)
+            if (baseAddress)
+                madvise(baseAddress, dataSize, MADV_SEQUENTIAL);
+#endif
+        }
+
         bool has_data() const
         {
             assert((mapping == 0) == (baseAddress == nullptr) && (baseAddress == nullptr) == (dataSize == 0));
@@ -473,5 +473,11 @@ bool save_eval(const std::optional<std::string>& filename, NetSize netSize) {
     return saved;
 }
 
+// Describes the pages which back the feature transformer, the largest part of the net
+std::string large_pages_info(NetSize netSize) {
+
+    return netSize == Small ? Stockfish::large_pages_info(featureTransformerSmall.get())
+                            : Stockfish::large_pages_info(featureTransformerBig.get());
+}
 
 }  // namespace Stockfish::Eval::NNUE
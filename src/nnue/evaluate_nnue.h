@@ -80,6 +80,8 @@ bool load_eval(const std::string name, std::istream& stream, NetSize netSize);
 bool save_eval(std::ostream& stream, NetSize netSize);
 bool save_eval(const std::optional<std::string>& filename, NetSize netSize);
 
+std::string large_pages_info(NetSize netSize);
+
 }  // namespace Stockfish::Eval::NNUE
 
 #endif  // #ifndef NNUE_EVALUATE_NNUE_H_INCLUDED
@@ -204,6 +204,86 @@ uint64_t perft(Position& pos, Depth depth) {
     return nodes;
 }
 
+// Limits the warm start, whose time is taken from the clock of the search
+struct WarmUpBudget {
+    TimePoint deadline;
+    uint64_t  positions = 0;
+
+    static constexpr uint64_t MaxPositions = 1 << 20;
+
+    // Checks the clock every 1024 positions only
+    bool exhausted() {
+        return ++positions >= MaxPositions || (!(positions % 1024) && now() >= deadline);
+    }
+};
+
+// Saves the best experience move of 'pos' to the TT, then does the same for the positions
+// reached by its experience moves, up to 'plies' moves ahead. Positions already in the TT
+// with at least the same depth are not walked again. Returns false once out of budget.
+// The best move comes from the experience index, the move list is only read to walk on.
+bool warm_up_tt(Position& pos, int ply, int plies, WarmUpBudget& budget) {
+
+    Experience::ExpBest best;
+    if (!Experience::probe_best(pos.key(), best))
+        return true;
+
+    if (budget.exhausted())
+        return false;
+
+    bool     found;
+    TTEntry* tte = TT.probe(pos.key(), found);
+    if (found && tte->depth() >= best.depth && tte->move() == best.move)
+        return true;
+
+    // Experience values are relative to the position they were stored for, as TT values are.
+    // The move of the experience is only known to be at least as good as its value.
+    if (!found || tte->depth() < best.depth)
+        tte->save(pos.key(), best.value, true, BOUND_LOWER, best.depth, best.move, VALUE_NONE);
+
+    if (ply >= plies)
+        return true;
+
+    const Experience::ExpEntryEx* exp = Experience::probe(pos.key());
+    if (!exp)
+        return true;
+
+    StateInfo st;
+    for (const Experience::ExpEntryEx* e = exp; e; e = e->next())
+    {
+        Move m = Move(e->move);
+        if (!pos.pseudo_legal(m) || !pos.legal(m))
+            continue;
+
+        pos.do_move(m, st);
+        bool more = warm_up_tt(pos, ply + 1, plies, budget);
+        pos.undo_move(m);
+
+        if (!more)
+            return false;
+    }
+
+    return true;
+}
+
+// Seeds the TT from the experience of the root position and of the positions up to
+// 'plies' moves ahead, so that the first iterations already search good moves first.
+// The walk is given a small share of the time of the move. It is skipped when that
+// share is too short to be worth it, and when searching for a number of nodes, which
+// the walk would count.
+void warm_up_tt(Position& root, int plies) {
+
+    TimePoint budgetTime = Limits.use_time_management() ? Time.optimum() / 32
+                         : Limits.movetime              ? Limits.movetime / 32
+                                                        : TimePoint(100);
+
+    if (Limits.npmsec || Limits.nodes || budgetTime < 2)
+        return;
+
+    WarmUpBudget budget;
+    budget.deadline = now() + budgetTime;
+
+    warm_up_tt(root, 0, plies, budget);
+}
 }  // namespace
 
 
@@ -243,6 +323,7 @@ void MainThread::search() {
 
     //Make sure experience has finished loading
     Experience::wait_for_loading_finished();
+    Experience::attach_search_thread();
 
     Color us = rootPos.side_to_move();
     Time.init(Limits, us, rootPos.game_ply());
@@ -290,7 +371,7 @@ void MainThread::search() {
                                 quality.emplace_back(temp, q.first);
                         }
 
-                        temp = temp->next;
+                        temp = temp->next();
                     }
 
                     // Sort experience moves based on quality
@@ -357,11 +438,16 @@ void MainThread::search() {
 
       if (think)
       {
+          if (int(Options["Experience TT Warm Start"]) && Experience::enabled())
+              warm_up_tt(rootPos, Options["Experience TT Warm Start"]);
+
           Threads.start_searching(); // start non-main threads
           Thread::search();          // main thread start searching
       }
   }
 
+    Experience::detach_search_thread();
+
     // When we reach the maximum depth, we can arrive here without a raise of
     // Threads.stop. However, if we are pondering or in an infinite search,
     // the UCI protocol states that we shouldn't print the best move before the
@@ -505,6 +591,10 @@ void Thread::search() {
 
     bestValue = -VALUE_INFINITE;
 
+    //Probe the copy of the experience index on the NUMA node of this thread, if enabled
+    if (Experience::enabled())
+        Experience::attach_search_thread();
+
     if (mainThread)
     {
         if (mainThread->bestPreviousScore == VALUE_INFINITE)
@@ -531,6 +621,9 @@ void Thread::search() {
     while (++rootDepth < MAX_PLY && !Threads.stop
            && !(Limits.depth && mainThread && rootDepth > Limits.depth))
     {
+        //Experience replaced by a reload is not used by this thread anymore
+        Experience::quiescent_point();
+
         // Age out PV variability metric
         if (mainThread)
             totBestMoveChanges /= 2;
@@ -700,6 +793,8 @@ void Thread::search() {
         iterIdx                        = (iterIdx + 1) & 3;
     }
 
+    Experience::detach_search_thread();
+
     if (!mainThread)
         return;
 
@@ -817,7 +912,7 @@ Value search(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth, boo
         ss->ttPv = PvNode || (ss->ttHit && tte->is_pv());
 
     //Probe experience data
-    const Experience::ExpEntryEx *expEx = excludedMove == MOVE_NONE && Experience::enabled() ? Experience::probe(pos.key()) : nullptr;
+    const Experience::ExpEntryEx *expEx = excludedMove == MOVE_NONE && Experience::enabled() ? Experience::probe(pos.key(), depth) : nullptr;
     const Experience::ExpEntryEx* tempExp = expEx;
     const Experience::ExpEntryEx* bestExp = nullptr;
 
@@ -875,7 +970,7 @@ Value search(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth, boo
             }
         }
 
-        tempExp = tempExp->next;
+        tempExp = tempExp->next();
     }
 
     //Increment tbHits
@@ -1141,8 +1236,11 @@ Value search(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth, boo
             {
                 assert(pos.capture_stage(move));
 
-                // Prefetch the TT entry for the resulting position
-                prefetch(TT.first_entry(pos.key_after(move)));
+                // Prefetch the TT entry and the experience for the resulting position
+                Key nextKey = pos.key_after(move);
+                prefetch(TT.first_entry(nextKey));
+                if (Experience::enabled())
+                    Experience::prefetch(nextKey);
 
                 ss->currentMove = move;
                 ss->continuationHistory =
@@ -1380,7 +1478,10 @@ moves_loop:  // When in check, search starts here
         ss->multipleExtensions = (ss - 1)->multipleExtensions + (extension >= 2);
 
         // Speculative prefetch as early as possible
-        prefetch(TT.first_entry(pos.key_after(move)));
+        Key nextKey = pos.key_after(move);
+        prefetch(TT.first_entry(nextKey));
+        if (Experience::enabled())
+            Experience::prefetch(nextKey);
 
         // Update the current move (this must be done after singular extension search)
         ss->currentMove = move;
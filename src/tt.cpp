@@ -22,12 +22,18 @@
 #include "tt.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <thread>
 #include <vector>
 
+#if defined(TT_CLUSTER_64) && defined(USE_SSE2)
+    #include <emmintrin.h>
+#endif
+
 #include "misc.h"
 #include "thread.h"
 #include "uci.h"
@@ -36,21 +42,56 @@ namespace Stockfish {
 
 TranspositionTable TT;  // Our global transposition table
 
+namespace {
+
+// A saved table is a header followed by the clusters, which start on a page
+// boundary so that the file can be mapped and copied in place.
+struct HashFileHeader {
+    char     signature[16];
+    uint32_t version;
+    uint32_t clusterSize;
+    uint64_t clusterCount;
+    uint8_t  generation8;
+};
+
+constexpr char     HashFileSignature[16] = "HypnoS TT";
+constexpr uint32_t HashFileVersion       = 1;
+constexpr size_t   HashFileDataOffset    = 4096;
+
+static_assert(sizeof(HashFileHeader) <= HashFileDataOffset);
+
+}  // namespace
+
 // Populates the TTEntry with a new node's data, possibly
 // overwriting an old position. The update is not atomic and can be racy.
+#if defined(TT_CLUSTER_64)
+// Returns the key of the entry, which lives in the key array at the start of
+// its cluster. Clusters are aligned to 64 bytes, so the cluster is found by
+// masking the low bits of the entry address.
+uint16_t* TTEntry::key_slot() {
+
+    auto* cluster =
+      reinterpret_cast<TranspositionTable::Cluster*>(uintptr_t(this) & ~uintptr_t(63));
+
+    return &cluster->key16[this - cluster->entry];
+}
+#endif
+
 void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev) {
 
+    uint16_t* const key = key_slot();
+
     // Preserve any existing move for the same position
-    if (m || uint16_t(k) != key16)
+    if (m || uint16_t(k) != *key)
         move16 = uint16_t(m);
 
     // Overwrite less valuable entries (cheapest checks first)
-    if (b == BOUND_EXACT || uint16_t(k) != key16 || d - DEPTH_OFFSET + 2 * pv > depth8 - 4)
+    if (b == BOUND_EXACT || uint16_t(k) != *key || d - DEPTH_OFFSET + 2 * pv > depth8 - 4)
     {
         assert(d > DEPTH_OFFSET);
         assert(d < 256 + DEPTH_OFFSET);
 
-        key16     = uint16_t(k);
+        *key      = uint16_t(k);
         depth8    = uint8_t(d - DEPTH_OFFSET);
         genBound8 = uint8_t(TT.generation8 | uint8_t(pv) << 2 | b);
         value16   = int16_t(v);
@@ -66,8 +107,11 @@ void TranspositionTable::resize(size_t mbSize) {
 
     Threads.main()->wait_for_search_finished();
 
+    stop_clear();
+    clearing.store(false, std::memory_order_release);
     aligned_large_pages_free(table);
 
+    hashMB       = mbSize;
     clusterCount = mbSize * 1024 * 1024 / sizeof(Cluster);
 
     table = static_cast<Cluster*>(aligned_large_pages_alloc(clusterCount * sizeof(Cluster)));
@@ -77,35 +121,238 @@ void TranspositionTable::resize(size_t mbSize) {
         exit(EXIT_FAILURE);
     }
 
+    // On NUMA machines, spread the table over all the nodes before it is first written
+    interleaved = WinProcGroup::interleave(table, clusterCount * sizeof(Cluster));
+
+    // The page backing is only known once the table has been written, so it is
+    // reported by the thread which zeroes the last chunk.
+    pagesPending.store(true, std::memory_order_relaxed);
     clear();
 }
 
 
-// Initializes the entire transposition table to zero,
-// in a multi-threaded way.
+void TranspositionTable::report_pages() const {
+
+    sync_cout << "info string Hash: " << hashMB << " MB on " << large_pages_info(table)
+              << (interleaved ? ", interleaved on " + std::to_string(WinProcGroup::node_count()) + " NUMA nodes" : "")
+              << sync_endl;
+}
+
+
+// Initializes the entire transposition table to zero, in the background.
+// It returns at once: helper threads zero the table chunk by chunk, and a search
+// which probes a chunk not zeroed yet zeroes it first.
 void TranspositionTable::clear() {
 
-    std::vector<std::thread> threads;
+    stop_clear();
+
+    chunkCount = (clusterCount + ClearChunkClusters - 1) / ClearChunkClusters;
+    chunkStates.reset(new std::atomic<uint8_t>[chunkCount]);
+
+    for (size_t c = 0; c < chunkCount; ++c)
+        chunkStates[c].store(CHUNK_PENDING, std::memory_order_relaxed);
 
-    for (size_t idx = 0; idx < size_t(Options["Threads"]); ++idx)
+    nextChunk.store(0, std::memory_order_relaxed);
+    pendingChunks.store(chunkCount, std::memory_order_relaxed);
+    clearStop.store(false, std::memory_order_relaxed);
+    clearYield.store(false, std::memory_order_relaxed);
+    clearing.store(true, std::memory_order_release);
+
+    // Options are read here only, as setoption may change them meanwhile
+    const size_t threads     = size_t(Options["Threads"]);
+    const size_t threadCount = std::min(threads, chunkCount);
+
+    for (size_t idx = 0; idx < threadCount; ++idx)
     {
-        threads.emplace_back([this, idx]() {
+        clearThreads.emplace_back([this, idx, threads]() {
             // Thread binding gives faster search on systems with a first-touch policy
-            if (Options["Threads"] > 8)
+            if (threads > 8)
                 WinProcGroup::bindThisThread(idx);
 
-            // Each thread will zero its part of the hash table
-            const size_t stride = size_t(clusterCount / Options["Threads"]),
-                         start  = size_t(stride * idx),
-                         len =
-                           idx != size_t(Options["Threads"]) - 1 ? stride : clusterCount - start;
+            // The first helper goes on while searching, without taking time from the search
+            if (!idx)
+                WinProcGroup::lower_priority();
 
-            std::memset(&table[start], 0, len * sizeof(Cluster));
+            for (size_t c; !clearStop.load(std::memory_order_relaxed)
+                           && !(idx && clearYield.load(std::memory_order_relaxed))
+                           && (c = nextChunk.fetch_add(1, std::memory_order_relaxed)) < chunkCount;)
+                if (chunkStates[c].load(std::memory_order_acquire) == CHUNK_PENDING)
+                    clear_chunk(c);
+        });
+    }
+}
+
+
+// Waits for the background clearing to be done, and zeroes the chunks left
+// by helper threads stopped for a search. Needed before the table is read or
+// written as a whole.
+void TranspositionTable::finish_clear() {
+
+    join_clear_threads();
+
+    if (clearing.load(std::memory_order_acquire))
+        for (size_t c = 0; c < chunkCount; ++c)
+            if (chunkStates[c].load(std::memory_order_acquire) != CHUNK_CLEARED)
+                clear_chunk(c);
+
+    clearing.store(false, std::memory_order_release);
+}
+
+
+void TranspositionTable::join_clear_threads() {
+
+    for (std::thread& th : clearThreads)
+        th.join();
+
+    clearThreads.clear();
+}
+
+
+// Stops the helper threads, leaving the chunks they did not reach as they are
+void TranspositionTable::stop_clear() {
+
+    clearStop.store(true, std::memory_order_relaxed);
+    join_clear_threads();
+}
+
+
+// Zeroes a chunk of the table unless another thread does it, in which case
+// it waits until the chunk is zeroed.
+void TranspositionTable::clear_chunk(size_t chunk) const {
+
+    uint8_t state = CHUNK_PENDING;
+    if (chunkStates[chunk].compare_exchange_strong(state, CHUNK_CLEARING, std::memory_order_acquire))
+    {
+        const size_t start = chunk * ClearChunkClusters,
+                     len   = std::min(ClearChunkClusters, clusterCount - start);
+
+        std::memset(&table[start], 0, len * sizeof(Cluster));
+        chunkStates[chunk].store(CHUNK_CLEARED, std::memory_order_release);
+
+        if (pendingChunks.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            clearing.store(false, std::memory_order_release);
+
+            if (pagesPending.exchange(false, std::memory_order_relaxed))
+                report_pages();
+        }
+        return;
+    }
+
+    // Sleep rather than yield: the chunk may be zeroed by the idle priority helper,
+    // which only runs on a processor left idle.
+    while (chunkStates[chunk].load(std::memory_order_acquire) != CHUNK_CLEARED)
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+}
+
+
+// Writes the table, with the current generation, to a file.
+// Entries keep their age, so a reloaded table resumes the search where it was.
+bool TranspositionTable::save(const std::string& fn) {
+
+    Threads.main()->wait_for_search_finished();
+    finish_clear();
+
+    std::ofstream out(fn, std::ios::out | std::ios::binary | std::ios::trunc);
+
+    HashFileHeader header{};
+    std::memcpy(header.signature, HashFileSignature, sizeof(header.signature));
+    header.version      = HashFileVersion;
+    header.clusterSize  = sizeof(Cluster);
+    header.clusterCount = clusterCount;
+    header.generation8  = generation8;
+
+    std::vector<char> page(HashFileDataOffset, 0);
+    std::memcpy(page.data(), &header, sizeof(header));
+    out.write(page.data(), page.size());
+
+    // Write in chunks, streams may not handle multi-GB writes at once
+    constexpr size_t ChunkSize = 64 * 1024 * 1024;
+    const char*      data      = reinterpret_cast<const char*>(table);
+    const size_t     size      = clusterCount * sizeof(Cluster);
+
+    for (size_t done = 0; done < size && out; done += ChunkSize)
+        out.write(data + done, std::streamsize(std::min(ChunkSize, size - done)));
+
+    out.close();
+
+    if (!out)
+    {
+        sync_cout << "info string Failed to save hash to file: " << fn << sync_endl;
+        std::remove(fn.c_str());
+        return false;
+    }
+
+    sync_cout << "info string Saved hash (" << format_bytes(size, 2) << ") to file: " << fn << sync_endl;
+    return true;
+}
+
+
+// Reads a table written by save(). The hash size changes to the one of the file
+// if needed, then the clusters are copied from the mapped file by several threads.
+bool TranspositionTable::load(const std::string& fn) {
+
+    Threads.main()->wait_for_search_finished();
+
+    Utility::FileMapping file;
+    if (!file.map(fn, false) || file.data_size() < HashFileDataOffset)
+    {
+        sync_cout << "info string Could not open hash file: " << fn << sync_endl;
+        return false;
+    }
+
+    HashFileHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    if (std::memcmp(header.signature, HashFileSignature, sizeof(header.signature))
+        || header.version != HashFileVersion || header.clusterSize != sizeof(Cluster)
+        || !header.clusterCount
+        || file.data_size() != HashFileDataOffset + header.clusterCount * sizeof(Cluster))
+    {
+        sync_cout << "info string The file [" << fn << "] is not a valid hash file" << sync_endl;
+        return false;
+    }
+
+    if (header.clusterCount != clusterCount)
+    {
+        const size_t mbSize = header.clusterCount * sizeof(Cluster) / (1024 * 1024);
+
+        sync_cout << "info string Changing hash size to " << mbSize << " MB to load the hash file" << sync_endl;
+        Options["Hash"] = std::to_string(mbSize);
+
+        if (header.clusterCount != clusterCount)
+        {
+            sync_cout << "info string Hash size " << mbSize << " MB of file [" << fn << "] is not supported" << sync_endl;
+            return false;
+        }
+    }
+
+    finish_clear();
+    file.advise_sequential();
+
+    const Cluster* data = reinterpret_cast<const Cluster*>(file.data() + HashFileDataOffset);
+    const size_t   threadCount = size_t(Options["Threads"]);
+
+    std::vector<std::thread> threads;
+
+    for (size_t idx = 0; idx < threadCount; ++idx)
+    {
+        threads.emplace_back([this, data, threadCount, idx]() {
+            const size_t stride = clusterCount / threadCount, start = stride * idx,
+                         len    = idx != threadCount - 1 ? stride : clusterCount - start;
+
+            std::memcpy(&table[start], &data[start], len * sizeof(Cluster));
         });
     }
 
     for (std::thread& th : threads)
         th.join();
+
+    generation8 = header.generation8;
+
+    sync_cout << "info string Loaded hash (" << format_bytes(clusterCount * sizeof(Cluster), 2)
+              << ") from file: " << fn << sync_endl;
+    return true;
 }
 
 
@@ -117,9 +364,61 @@ void TranspositionTable::clear() {
 // TTEntry t2 if its replace value is greater than that of t2.
 TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
 
+    if (clearing.load(std::memory_order_acquire))
+    {
+        const size_t chunk = mul_hi64(key, clusterCount) / ClearChunkClusters;
+        if (chunkStates[chunk].load(std::memory_order_acquire) != CHUNK_CLEARED)
+            clear_chunk(chunk);
+    }
+
     TTEntry* const tte   = first_entry(key);
     const uint16_t key16 = uint16_t(key);  // Use the low 16 bits as key inside the cluster
 
+#if defined(TT_CLUSTER_64)
+    Cluster* const  cl   = reinterpret_cast<Cluster*>(uintptr_t(tte) & ~uintptr_t(63));
+    const uint16_t* keys = cl->key16;
+
+    // Entries are filled in order and never emptied until the next clear, so
+    // the first lane holding either our key or an empty entry is the answer.
+    // An empty entry has a zero key, which narrows the scan to those lanes.
+    #if defined(USE_SSE2)
+    const __m128i k    = _mm_load_si128(reinterpret_cast<const __m128i*>(keys));
+    const __m128i hits = _mm_or_si128(_mm_cmpeq_epi16(k, _mm_set1_epi16(short(key16))),
+                                      _mm_cmpeq_epi16(k, _mm_setzero_si128()));
+    unsigned      mask = unsigned(_mm_movemask_epi8(hits)) & ((1u << (2 * ClusterSize)) - 1);
+
+    while (mask)
+    {
+        const int i = int(lsb(Bitboard(mask))) / 2;
+        mask &= ~(3u << (2 * i));  // Each lane sets two bits of the byte mask
+    #else
+    for (int i = 0; i < ClusterSize; ++i)
+    {
+    #endif
+        if (keys[i] == key16 || !tte[i].depth8)
+        {
+            tte[i].genBound8 =
+              uint8_t(generation8 | (tte[i].genBound8 & (GENERATION_DELTA - 1)));  // Refresh
+
+            return found = bool(tte[i].depth8), &tte[i];
+        }
+    }
+
+    // Find an entry to be replaced. With twice the entries per cluster an
+    // old entry survives longer, so age weighs more against depth, and PV
+    // entries get a small bonus to keep them over deeper non-PV leftovers.
+    auto worth = [&](const TTEntry& e) {
+        return e.depth8 + 4 * bool(e.genBound8 & 0x4)
+             - 2 * ((GENERATION_CYCLE + generation8 - e.genBound8) & GENERATION_MASK);
+    };
+
+    TTEntry* replace = tte;
+    for (int i = 1; i < ClusterSize; ++i)
+        if (worth(*replace) > worth(tte[i]))
+            replace = &tte[i];
+
+    return found = false, replace;
+#else
     for (int i = 0; i < ClusterSize; ++i)
         if (tte[i].key16 == key16 || !tte[i].depth8)
         {
@@ -144,6 +443,7 @@ TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
             replace = &tte[i];
 
     return found = false, replace;
+#endif
 }
 
 
@@ -152,6 +452,10 @@ TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
 
 int TranspositionTable::hashfull() const {
 
+    if (clearing.load(std::memory_order_acquire)
+        && chunkStates[0].load(std::memory_order_acquire) != CHUNK_CLEARED)
+        clear_chunk(0);
+
     int cnt = 0;
     for (int i = 0; i < 1000; ++i)
         for (int j = 0; j < ClusterSize; ++j)
@@ -22,8 +22,13 @@
 #ifndef TT_H_INCLUDED
 #define TT_H_INCLUDED
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "misc.h"
 #include "types.h"
@@ -32,7 +37,7 @@ namespace Stockfish {
 
 // TTEntry struct is the 10 bytes transposition table entry, defined as below:
 //
-// key        16 bit
+// key        16 bit (kept in the cluster, out of the entry, with TT_CLUSTER_64)
 // depth       8 bit
 // generation  5 bit
 // pv node     1 bit
@@ -53,7 +58,13 @@ struct TTEntry {
    private:
     friend class TranspositionTable;
 
+#if defined(TT_CLUSTER_64)
+    uint16_t* key_slot();
+#else
+    uint16_t* key_slot() { return &key16; }
+
     uint16_t key16;
+#endif
     uint8_t  depth8;
     uint8_t  genBound8;
     uint16_t move16;
@@ -69,6 +80,18 @@ struct TTEntry {
 // prefetched when possible.
 class TranspositionTable {
 
+#if defined(TT_CLUSTER_64)
+    // A cluster fills a cache line. The keys of its entries are grouped at the
+    // start of the line, so that all of them are matched by a single compare.
+    static constexpr int ClusterSize = 6;
+
+    struct alignas(64) Cluster {
+        uint16_t key16[8];  // The last two keys are padding, always zero
+        TTEntry  entry[ClusterSize];
+    };
+
+    static_assert(sizeof(Cluster) == 64, "Unexpected Cluster size");
+#else
     static constexpr int ClusterSize = 3;
 
     struct Cluster {
@@ -77,6 +100,19 @@ class TranspositionTable {
     };
 
     static_assert(sizeof(Cluster) == 32, "Unexpected Cluster size");
+#endif
+
+    // The table is cleared in the background by chunks of 2MB. A chunk is zeroed by
+    // the first thread which needs it, so entries written before clear() are never seen.
+    // When a search starts, the helper threads stop but the first one, which goes on
+    // at idle priority, so that the search rarely has to zero chunks itself.
+    static constexpr size_t ClearChunkClusters = 2 * 1024 * 1024 / sizeof(Cluster);
+
+    enum ChunkState : uint8_t {
+        CHUNK_CLEARED,
+        CHUNK_PENDING,
+        CHUNK_CLEARING
+    };
 
     // Constants used to refresh the hash table periodically
     static constexpr unsigned GENERATION_BITS = 3;  // nb of bits reserved for other things
@@ -87,12 +123,21 @@ class TranspositionTable {
       (0xFF << GENERATION_BITS) & 0xFF;  // mask to pull out generation number
 
    public:
-    ~TranspositionTable() { aligned_large_pages_free(table); }
-    void new_search() { generation8 += GENERATION_DELTA; }  // Lower bits are used for other things
+    ~TranspositionTable() {
+        stop_clear();
+        aligned_large_pages_free(table);
+    }
+    void new_search() {
+        clearYield.store(true, std::memory_order_relaxed);  // Leave the cores to the search
+        generation8 += GENERATION_DELTA;                     // Lower bits are used for other things
+    }
     TTEntry* probe(const Key key, bool& found) const;
     int      hashfull() const;
     void     resize(size_t mbSize);
     void     clear();
+    void     finish_clear();
+    bool     save(const std::string& fn);
+    bool     load(const std::string& fn);
 
     TTEntry* first_entry(const Key key) const {
         return &table[mul_hi64(key, clusterCount)].entry[0];
@@ -101,9 +146,29 @@ class TranspositionTable {
    private:
     friend struct TTEntry;
 
+    void clear_chunk(size_t chunk) const;
+    void join_clear_threads();
+    void stop_clear();
+    void report_pages() const;
+
     size_t   clusterCount;
     Cluster* table;
     uint8_t  generation8;  // Size must be not bigger than TTEntry::genBound8
+
+    // State of the background clearing
+    mutable std::atomic<bool>                  clearing{false};
+    std::unique_ptr<std::atomic<uint8_t>[]>    chunkStates;
+    size_t                                     chunkCount = 0;
+    mutable std::atomic<size_t>                pendingChunks{0};
+    std::atomic<size_t>                        nextChunk{0};
+    std::atomic<bool>                          clearStop{false};
+    std::atomic<bool>                          clearYield{false};
+    std::vector<std::thread>                   clearThreads;
+
+    // Page backing of a resized table, reported once it is fully written
+    mutable std::atomic<bool> pagesPending{false};
+    size_t                    hashMB      = 0;
+    bool                      interleaved = false;
 };
 
 extern TranspositionTable TT;
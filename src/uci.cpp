@@ -317,6 +317,9 @@ void UCI::loop(int argc, char* argv[]) {
 
           sync_cout << "readyok" << sync_endl;
       }
+        //Can be used during a search: the search goes on with the current experience until the file is loaded
+        else if (token == "exp_reload")
+            Experience::reload();
         // Add custom non-UCI commands, mainly for debugging purposes.
         // These commands must not be used during a search!
         else if (token == "flip")
@@ -335,12 +338,18 @@ void UCI::loop(int argc, char* argv[]) {
 			Experience::defrag(argc - 2, argv + 2);
         else if (argc > 2 && token == "merge")
 			Experience::merge(argc - 2, argv + 2);
+        else if (argc > 2 && token == "exp_stats")
+			Experience::stats(argc - 2, argv + 2);
+        else if (argc > 2 && token == "exp_prune")
+			Experience::prune(argc - 2, argv + 2);
         else if (token == "exp")
 			Experience::show_exp(pos, false);
         else if (token == "expex")
 			Experience::show_exp(pos, true);
         else if (argc > 2 && token == "convert_compact_pgn")
 			Experience::convert_compact_pgn(argc - 2, argv + 2);
+        else if (argc > 2 && token == "convert_pgn")
+			Experience::convert_pgn(argc - 2, argv + 2);
         else if (token == "export_net")
         {
             std::optional<std::string> filename;
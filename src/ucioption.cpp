@@ -52,6 +52,8 @@ namespace UCI {
 // 'On change' actions, triggered by an option's value change
 static void on_clear_hash(const Option&) { Search::clear(); }
 static void on_hash_size(const Option& o) { TT.resize(size_t(o)); }
+static void on_save_hash(const Option&) { TT.save(Utility::map_path(Options["Hash File"])); }
+static void on_load_hash(const Option&) { TT.load(Utility::map_path(Options["Hash File"])); }
 static void on_logger(const Option& o) { start_logger(o); }
 static void on_threads(const Option& o) { Threads.set(size_t(o)); }
 static void on_book1(const Option& o) { Book::on_book(0, (string) o); }
@@ -59,6 +61,7 @@ static void on_book2(const Option& o) { Book::on_book(1, (string) o); }
 static void on_tb_path(const Option& o) { Tablebases::init(o); }
 static void on_exp_enabled(const Option& /*o*/) { Experience::init(); }
 static void on_exp_file(const Option& /*o*/) { Experience::init(); }
+static void on_exp_numa_replicas(const Option& o) { Experience::set_numa_replicas(o); }
 static void on_eval_file(const Option&) { Eval::NNUE::init(); }
 static void on_materialistic_evaluation_strategy(const Option& o) { Eval::NNUE::MaterialisticEvaluationStrategy = 10 * (int)o; }
 static void on_positional_evaluation_strategy(const Option& o) { Eval::NNUE::PositionalEvaluationStrategy = 10 * (int)o; }
@@ -80,6 +83,9 @@ void init(OptionsMap& o) {
     o["Threads"]                             << Option(1, 1, 1024, on_threads);
     o["Hash"]                                << Option(16, 1, MaxHashMB, on_hash_size);
     o["Clear Hash"]                          << Option(on_clear_hash);
+    o["Hash File"]                           << Option("Hypnos.hsh");
+    o["Save Hash to File"]                   << Option(on_save_hash);
+    o["Load Hash from File"]                 << Option(on_load_hash);
     o["Ponder"]                              << Option(false);
     o["MultiPV"]                             << Option(1, 1, 500);
     o["Skill Level"]                         << Option(20, 0, 20);
@@ -105,6 +111,9 @@ void init(OptionsMap& o) {
     o["Experience Enabled"]                  << Option(true, on_exp_enabled);
     o["Experience File"]                     << Option("Hypnos.exp", on_exp_file);
     o["Experience Readonly"]                 << Option(false);
+    o["Experience Journal"]                  << Option(false);
+    o["Experience NUMA Replicas"]            << Option(false, on_exp_numa_replicas);
+    o["Experience TT Warm Start"]            << Option(0, 0, 20);
     o["Experience Book"]                     << Option(false);
     o["Experience Book Width"]               << Option(1, 1, 20);
     o["Experience Book Eval Importance"]     << Option(5, 0, 10);